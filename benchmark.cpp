@@ -0,0 +1,471 @@
+/******************************************************************************************************
+ * bloomfilter_lock:
+ * A framework for scalable read/write locking.
+ * Released under the terms of the MIT License: https://opensource.org/licenses/MIT
+ *
+ * benchmark:
+ * Sweeps thread count, read ratio, keys per request, key distribution and critical section length
+ * over BloomFilterLock, with and without exact key verification, and two baselines, a std::shared_mutex
+ * and an array of striped std::mutexes, and reports throughput and acquisition latency percentiles for
+ * each combination. The hand-off table then reports the latency from an unlock to the acquisition by
+ * the next holder with every thread writing the same resource, for each thread count.
+ *
+ * Usage: bloomfilter_lock_benchmark [--threads=1,2,4] [--reads=95,50] [--keys=1,4]
+ *                                   [--dist=uniform,zipf,prefix] [--cs=0,200] [--ops=20000]
+ *                                   [--handoff=20000]
+ *****************************************************************************************************/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include "bloomfilter_lock.hpp"
+#include <memory>
+#include <random>
+#include <shared_mutex>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+
+typedef std::chrono::steady_clock steady_clock_t;
+
+namespace
+{
+    constexpr size_t num_resources = 4096;
+    constexpr size_t max_keys = 8;
+    constexpr size_t num_stripes = 64;
+    // Share of the requests of the prefix distribution which lock a whole group of resources.
+    constexpr size_t prefix_percent = 10;
+
+    enum Distribution
+    {
+        Uniform = 0,
+        Zipfian = 1,
+        Prefix = 2
+    };
+
+    const char* distribution_names[] = {"uniform", "zipf", "prefix"};
+
+    struct Workload
+    {
+        size_t threads;
+        size_t read_percent;
+        size_t keys;
+        Distribution distribution;
+        size_t critical_section; // _cpu_relax iterations while holding the lock.
+        size_t ops; // Per thread.
+    };
+
+    struct Request
+    {
+    /* Request
+     * One pre-generated lock request. Resource i maps to a key whose slot 0 is i % 64, so a prefix
+     * request on a resource covers every resource in the same group of i % 64, which is also the
+     * stripe of the resource in the striped mutex baseline.
+     */
+        uint32_t resources[max_keys];
+        bool writes[max_keys];
+        size_t count;
+        bool prefix; // Lock the whole group of resources[0].
+        bool read_only;
+    };
+
+    uint32_t resource_key(uint32_t resource)
+    {
+        uint32_t mixed = resource * 2654435761u;
+        return (resource % 64) | ((mixed >> 8) & 0x3F3F3F00) | 0x00000100;
+    }
+
+    class ZipfianGenerator
+    {
+    public:
+        explicit ZipfianGenerator(size_t n, double s = 0.99):
+            m_cdf(n)
+        {
+            double sum = 0;
+            for (size_t i = 0; i < n; ++i)
+                m_cdf[i] = (sum += 1.0 / std::pow(double(i + 1), s));
+            for (auto& p: m_cdf)
+                p /= sum;
+        }
+
+        template <typename Generator>
+        uint32_t operator()(Generator& generator)
+        {
+            double u = std::uniform_real_distribution<double>(0, 1)(generator);
+            return std::lower_bound(m_cdf.begin(), m_cdf.end(), u) - m_cdf.begin();
+        }
+
+    private:
+        std::vector<double> m_cdf;
+    };
+
+    std::vector<Request> generate_requests(const Workload& w, uint32_t seed)
+    {
+        std::mt19937 generator(seed);
+        std::uniform_int_distribution<uint32_t> uniform(0, num_resources - 1);
+        std::uniform_int_distribution<size_t> percent(0, 99);
+        static ZipfianGenerator zipfian(num_resources);
+
+        std::vector<Request> requests(w.ops);
+        for (auto& r: requests)
+        {
+            r.count = std::min(w.keys, max_keys);
+            r.prefix = (w.distribution == Prefix && percent(generator) < prefix_percent);
+            r.read_only = true;
+            for (size_t i = 0; i < r.count; ++i)
+            {
+                uint32_t resource;
+                do
+                {
+                    resource = (w.distribution == Zipfian) ? zipfian(generator) : uniform(generator);
+                }
+                while (std::find(r.resources, r.resources + i, resource) != r.resources + i);
+                r.resources[i] = resource;
+                r.writes[i] = percent(generator) >= w.read_percent;
+                r.read_only = r.read_only && not r.writes[i];
+            }
+            if (r.prefix)
+            {
+                r.count = 1;
+                r.read_only = not r.writes[0];
+            }
+        }
+        return requests;
+    }
+
+
+    template <typename LockType>
+    class BloomFilterLockAdaptor
+    {
+    public:
+        void lock(const Request& r)
+        {
+            if (r.count == 1)
+            {
+                bloomfilter_lock::Key key(resource_key(r.resources[0]));
+                if (r.prefix)
+                    key = key.prefix_key(1);
+                if (r.writes[0])
+                    m_lock.write_lock(key);
+                else
+                    m_lock.read_lock(key);
+                return;
+            }
+
+            bloomfilter_lock::LockIntention intention;
+            for (size_t i = 0; i < r.count; ++i)
+            {
+                if (r.writes[i])
+                    intention.add_write_key(resource_key(r.resources[i]));
+                else
+                    intention.add_read_key(resource_key(r.resources[i]));
+            }
+            m_lock.multilock(intention);
+        }
+
+        void unlock(const Request&)
+        {
+            m_lock.unlock();
+        }
+
+    private:
+        LockType m_lock;
+    };
+
+
+    class SharedMutexAdaptor
+    {
+    public:
+        void lock(const Request& r)
+        {
+            if (r.read_only)
+                m_lock.lock_shared();
+            else
+                m_lock.lock();
+        }
+
+        void unlock(const Request& r)
+        {
+            if (r.read_only)
+                m_lock.unlock_shared();
+            else
+                m_lock.unlock();
+        }
+
+    private:
+        std::shared_mutex m_lock;
+    };
+
+
+    class StripedMutexAdaptor
+    {
+    /* StripedMutexAdaptor
+     * Locks the stripe of every resource of a request in ascending stripe order. Reads are exclusive.
+     */
+    public:
+        void lock(const Request& r)
+        {
+            for (auto stripe: stripes(r))
+                m_stripes[stripe].m_mutex.lock();
+        }
+
+        void unlock(const Request& r)
+        {
+            for (auto stripe: stripes(r))
+                m_stripes[stripe].m_mutex.unlock();
+        }
+
+    private:
+        static std::vector<uint32_t>& stripes(const Request& r)
+        {
+            thread_local std::vector<uint32_t> result;
+            result.clear();
+            for (size_t i = 0; i < r.count; ++i)
+                result.push_back(r.resources[i] % num_stripes);
+            std::sort(result.begin(), result.end());
+            result.erase(std::unique(result.begin(), result.end()), result.end());
+            return result;
+        }
+
+        struct alignas(bloomfilter_lock::_cache_line_size) Stripe
+        {
+            std::mutex m_mutex;
+        };
+
+        Stripe m_stripes[num_stripes];
+    };
+
+
+    struct Result
+    {
+        double ops_per_second;
+        uint64_t p50;
+        uint64_t p99;
+        uint64_t p999;
+    };
+
+    template <typename Adaptor>
+    Result run(const Workload& w)
+    {
+        auto adaptor = std::make_unique<Adaptor>();
+        std::vector<std::vector<Request>> requests;
+        std::vector<std::vector<uint64_t>> latencies(w.threads, std::vector<uint64_t>(w.ops));
+        for (size_t t = 0; t < w.threads; ++t)
+            requests.push_back(generate_requests(w, t + 1));
+
+        std::atomic<size_t> ready(0);
+        std::atomic<bool> go(false);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < w.threads; ++t)
+        {
+            threads.emplace_back([&, t]()
+            {
+                ++ready;
+                while (not go.load(std::memory_order_acquire))
+                    std::this_thread::yield();
+
+                for (size_t i = 0; i < w.ops; ++i)
+                {
+                    const Request& r = requests[t][i];
+                    auto start = steady_clock_t::now();
+                    adaptor->lock(r);
+                    latencies[t][i] = std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock_t::now() - start).count();
+                    for (size_t j = 0; j < w.critical_section; ++j)
+                        bloomfilter_lock::_cpu_relax();
+                    adaptor->unlock(r);
+                }
+            });
+        }
+
+        while (ready.load() != w.threads)
+            std::this_thread::yield();
+        auto start = steady_clock_t::now();
+        go.store(true, std::memory_order_release);
+        std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+        double seconds = std::chrono::duration<double>(steady_clock_t::now() - start).count();
+
+        std::vector<uint64_t> all;
+        for (auto& l: latencies)
+            all.insert(all.end(), l.begin(), l.end());
+        std::sort(all.begin(), all.end());
+        auto percentile = [&all](double p) {return all[std::min<size_t>(all.size() - 1, p * all.size())];};
+        return Result{all.size() / seconds, percentile(0.5), percentile(0.99), percentile(0.999)};
+    }
+
+    // Every thread writes resource 0, the latency is from the unlock of the previous holder, if that was
+    // another thread, to the acquisition.
+    template <typename Adaptor>
+    Result run_handoff(size_t num_threads, size_t ops)
+    {
+        auto adaptor = std::make_unique<Adaptor>();
+        Request r{};
+        r.count = 1;
+        r.writes[0] = true;
+        // Guarded by the lock under test.
+        uint64_t released_at = 0;
+        size_t released_by = num_threads;
+        std::vector<std::vector<uint64_t>> latencies(num_threads);
+
+        std::atomic<size_t> ready(0);
+        std::atomic<bool> go(false);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < num_threads; ++t)
+        {
+            latencies[t].reserve(ops);
+            threads.emplace_back([&, t]()
+            {
+                ++ready;
+                while (not go.load(std::memory_order_acquire))
+                    std::this_thread::yield();
+
+                for (size_t i = 0; i < ops; ++i)
+                {
+                    adaptor->lock(r);
+                    uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        steady_clock_t::now().time_since_epoch()).count();
+                    if (released_by != t && released_by != num_threads)
+                        latencies[t].push_back(now - released_at);
+                    released_by = t;
+                    released_at = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        steady_clock_t::now().time_since_epoch()).count();
+                    adaptor->unlock(r);
+                }
+            });
+        }
+
+        while (ready.load() != num_threads)
+            std::this_thread::yield();
+        auto start = steady_clock_t::now();
+        go.store(true, std::memory_order_release);
+        std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+        double seconds = std::chrono::duration<double>(steady_clock_t::now() - start).count();
+
+        std::vector<uint64_t> all;
+        for (auto& l: latencies)
+            all.insert(all.end(), l.begin(), l.end());
+        std::sort(all.begin(), all.end());
+        // A single thread never hands off.
+        auto percentile = [&all](double p) {return all.empty() ? 0 : all[std::min<size_t>(all.size() - 1, p * all.size())];};
+        return Result{num_threads * ops / seconds, percentile(0.5), percentile(0.99), percentile(0.999)};
+    }
+
+    std::vector<size_t> parse_list(const char* value)
+    {
+        std::vector<size_t> result;
+        for (const char* p = value; *p; )
+        {
+            char* end;
+            result.push_back(strtoul(p, &end, 10));
+            p = (*end == ',') ? end + 1 : end;
+            if (end == p && *p)
+                break;
+        }
+        return result;
+    }
+
+    std::vector<Distribution> parse_distributions(const char* value)
+    {
+        std::vector<Distribution> result;
+        std::string list(value);
+        for (size_t i = 0; i < 3; ++i)
+        {
+            if (list.find(distribution_names[i]) != std::string::npos)
+                result.push_back(Distribution(i));
+        }
+        return result;
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    size_t num_cores = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    std::vector<size_t> thread_counts = {1, std::max<size_t>(num_cores / 2, 1), num_cores};
+    std::vector<size_t> read_percents = {95, 50};
+    std::vector<size_t> key_counts = {1, 4};
+    std::vector<Distribution> distributions = {Uniform, Zipfian, Prefix};
+    std::vector<size_t> critical_sections = {0, 200};
+    size_t ops = 20000;
+    size_t handoff_ops = 20000;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* value = strchr(argv[i], '=');
+        value = value ? value + 1 : "";
+        if (not strncmp(argv[i], "--threads=", 10))
+            thread_counts = parse_list(value);
+        else if (not strncmp(argv[i], "--reads=", 8))
+            read_percents = parse_list(value);
+        else if (not strncmp(argv[i], "--keys=", 7))
+            key_counts = parse_list(value);
+        else if (not strncmp(argv[i], "--dist=", 7))
+            distributions = parse_distributions(value);
+        else if (not strncmp(argv[i], "--cs=", 5))
+            critical_sections = parse_list(value);
+        else if (not strncmp(argv[i], "--ops=", 6))
+            ops = strtoul(value, nullptr, 10);
+        else if (not strncmp(argv[i], "--handoff=", 10))
+            handoff_ops = strtoul(value, nullptr, 10);
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    thread_counts.erase(std::unique(thread_counts.begin(), thread_counts.end()), thread_counts.end());
+
+    printf("%-28s %7s %5s %4s %-7s %5s %12s %9s %9s %9s\n", "lock", "threads", "reads", "keys", "dist", "cs",
+           "ops/s", "p50(ns)", "p99(ns)", "p999(ns)");
+    for (auto threads: thread_counts)
+        for (auto read_percent: read_percents)
+            for (auto keys: key_counts)
+                for (auto distribution: distributions)
+                    for (auto critical_section: critical_sections)
+                    {
+                        Workload w{threads, read_percent, keys, distribution, critical_section, ops};
+                        auto report = [&w](const char* name, const Result& r)
+                        {
+                            printf("%-28s %7zu %5zu %4zu %-7s %5zu %12.0f %9lu %9lu %9lu\n", name, w.threads,
+                                   w.read_percent, w.keys, distribution_names[w.distribution], w.critical_section,
+                                   r.ops_per_second, r.p50, r.p99, r.p999);
+                            fflush(stdout);
+                        };
+                        report("BloomFilterLock<std::mutex>",
+                               run<BloomFilterLockAdaptor<bloomfilter_lock::BloomFilterLock<std::mutex>>>(w));
+                        report("BloomFilterLock<_SpinLock>",
+                               run<BloomFilterLockAdaptor<bloomfilter_lock::BloomFilterLock<bloomfilter_lock::_SpinLock>>>(w));
+                        report("BloomFilterLock exact keys",
+                               run<BloomFilterLockAdaptor<bloomfilter_lock::BloomFilterLock<std::mutex,
+                                   bloomfilter_lock::FutexWaitPolicy, bloomfilter_lock::FixedMergeLimits<8, 8, 8>>>>(w));
+                        report("BloomFilterLock chained wake",
+                               run<BloomFilterLockAdaptor<bloomfilter_lock::BloomFilterLock<bloomfilter_lock::_SpinLock,
+                                   bloomfilter_lock::ChainedWakeWaitPolicy<>>>>(w));
+                        report("std::shared_mutex", run<SharedMutexAdaptor>(w));
+                        report("striped std::mutex", run<StripedMutexAdaptor>(w));
+                    }
+
+    if (not handoff_ops)
+        return 0;
+    printf("\n%-28s %7s %12s %9s %9s %9s\n", "hand-off", "threads", "ops/s", "p50(ns)", "p99(ns)", "p999(ns)");
+    for (auto threads: thread_counts)
+    {
+        auto report = [threads](const char* name, const Result& r)
+        {
+            printf("%-28s %7zu %12.0f %9lu %9lu %9lu\n", name, threads, r.ops_per_second, r.p50, r.p99, r.p999);
+            fflush(stdout);
+        };
+        report("BloomFilterLock<std::mutex>",
+               run_handoff<BloomFilterLockAdaptor<bloomfilter_lock::BloomFilterLock<std::mutex>>>(threads, handoff_ops));
+        report("BloomFilterLock<_SpinLock>",
+               run_handoff<BloomFilterLockAdaptor<bloomfilter_lock::BloomFilterLock<bloomfilter_lock::_SpinLock>>>(
+                   threads, handoff_ops));
+        report("BloomFilterLock chained wake",
+               run_handoff<BloomFilterLockAdaptor<bloomfilter_lock::BloomFilterLock<bloomfilter_lock::_SpinLock,
+                   bloomfilter_lock::ChainedWakeWaitPolicy<>>>>(threads, handoff_ops));
+        report("std::shared_mutex", run_handoff<SharedMutexAdaptor>(threads, handoff_ops));
+    }
+    return 0;
+}
@@ -6,11 +6,13 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <exception>
 #include <iostream>
 #include <mutex>
 #include <pthread.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <unordered_map>
 #include <vector>
@@ -18,29 +20,68 @@
 #include <linux/futex.h>
 #include <unistd.h>
 #include <sys/syscall.h>
+#include <thread>
 #include <errno.h>
 #include <bits/stdc++.h> 
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+// USDT probes of UsdtInstrumentation, which compile away without systemtap's header.
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define _BLOOMFILTER_LOCK_PROBE1(name, a) DTRACE_PROBE1(bloomfilter_lock, name, a)
+#define _BLOOMFILTER_LOCK_PROBE2(name, a, b) DTRACE_PROBE2(bloomfilter_lock, name, a, b)
+#define _BLOOMFILTER_LOCK_PROBE3(name, a, b, c) DTRACE_PROBE3(bloomfilter_lock, name, a, b, c)
+#else
+#define _BLOOMFILTER_LOCK_PROBE1(name, a) ((void)(a))
+#define _BLOOMFILTER_LOCK_PROBE2(name, a, b) ((void)(a), (void)(b))
+#define _BLOOMFILTER_LOCK_PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#endif
 
 namespace bloomfilter_lock
 {
 
-    template <typename T>
+    template <typename InternalLockType, typename WaitPolicy, typename MergePolicy, typename Instrumentation,
+              size_t KeySlots, typename Tracking>
     class BloomFilterLock;
+    template <size_t Slots>
     class _LockRecord;
-    class LockIntention;    
+    template <size_t Slots>
+    struct BasicLockIntention;
+    template <typename LockType>
+    class BatchHandle;
+
+    // Assumed cache line size used to keep independently written fields apart.
+    constexpr size_t _cache_line_size = 64;
     
 
-    class Key
+    // Integer type holding one byte per key slot.
+    template <size_t Slots>
+    struct _KeyStorage;
+    template <>
+    struct _KeyStorage<4> {typedef uint32_t type;};
+    template <>
+    struct _KeyStorage<8> {typedef uint64_t type;};
+
+
+    template <size_t Slots>
+    class BasicKey
     {
     /*
      * Key:
      * Identifies a range of the key space to lock.
-     * In this implementation, the key space is a 4 tuple
-     * (0-63, 0-63, 0-63, 0-63) which is derived from the low 6 bits
-     * of each byte of a uint32_t which can be passed in or generated at random.
-     * The key space generated by this scheme is 2^24 which is sufficient to guarantee
-     * fine grain locking for just about all applications.  If a larger key space is
-     * required the technique can be extended easily at the expense of a bigger key object.
+     * In this implementation, the key space is a Slots tuple
+     * (0-63, 0-63, ...) which is derived from the low 6 bits
+     * of each byte of an integer of Slots bytes which can be passed in or generated at random.
+     * The default Key has 4 slots held in a uint32_t. The key space generated by this scheme is 2^24
+     * which is sufficient to guarantee fine grain locking for just about all applications.  If a larger key
+     * space is required BasicKey<8>, held in a uint64_t, extends it to 2^48 at the expense of a bigger
+     * key object and twice the bloom filter bits per lock record.
      * Note that the technique used in this example does not rely on independent (and computationally intensive)
      * hash functions as such schemes will either entail a time penalty to keep calculating the hash or a memory
      * penalty to save the result of the calculation.  The predicted max number of items concurrently in the filter
@@ -51,164 +92,481 @@ namespace bloomfilter_lock
      * Key(0) is a special value. It indicates a null locking request. It will not result in any locks being obtained.
      * A random number key generation scheme should bitwise or the result of
      * random number generation with 0x01 or some other bit which is present in 0x3F3F3F3F to guarantee the result is
-     * a valid key. Any key which bitwise ands with 0xC0C0C0C0 to a non-zero value maps to the 0 key.
+     * a valid key, or use from_id. Any key which bitwise ands with 0xC0C0C0C0 to a non-zero value maps to the 0 key.
+     * Keys are literal types, so fixed keys and the intentions built from them can be computed at compile
+     * time, see make_intention. Slot i is byte i of the integer counted from the least significant byte.
      */
     public:
-        Key(uint32_t key):
-        m_ui32(key & 0x3F3F3F3F)
+        static_assert(Slots == 4 || Slots == 8, "Keys have 4 or 8 slots");
+        typedef typename _KeyStorage<Slots>::type value_type;
+        static constexpr size_t num_slots = Slots;
+
+        constexpr BasicKey(value_type key):
+        m_value(key & value_type(0x3F3F3F3F3F3F3F3Full))
+        {
+        }
+
+        /* from_id:
+         * Maps an arbitrary 64 bit id, such as an object address or a database row id, to a valid non-zero
+         * key. The id is mixed so that ids differing in any bit spread over all slots. Distinct ids can map
+         * to the same key, which only results in false conflicts.
+         */
+        static constexpr BasicKey from_id(uint64_t id)
         {
+            // splitmix64 finalizer.
+            id = (id ^ (id >> 30)) * 0xBF58476D1CE4E5B9ull;
+            id = (id ^ (id >> 27)) * 0x94D049BB133111EBull;
+            id ^= id >> 31;
+            if (Slots == 4)
+                id ^= id >> 32;
+
+            BasicKey key(static_cast<value_type>(id));
+            return key.m_value ? key : BasicKey(1);
         }
 
-        uint32_t value () const {return m_ui32;}
+        constexpr value_type value () const {return m_value;}
+
+        // Returns the 0-63 value of the given slot (0 to Slots - 1) of the key.
+        constexpr uint8_t slot(size_t index) const {return _byte(index) & 0x3F;}
        
         /* prefix_key:
          * Return a Key which can be used to lock all keys sharing a prefix of prefix_length bytes with this key.
-         * A prefix length of 0 will return a copy of this same key. A prefix length greater than 3 is equivalent to
-         * a prefix length of 3
+         * A prefix length of 0 will return a copy of this same key. A prefix length greater than Slots - 1 is
+         * equivalent to a prefix length of Slots - 1
          */
-        Key prefix_key(uint8_t prefix_length = 1)
+        constexpr BasicKey prefix_key(uint8_t prefix_length = 1) const
         {
-            return Key(*this, prefix_length);
+            return BasicKey(*this, prefix_length);
         }
             
     private:
         
-        template <typename T>
+        template <typename InternalLockType, typename WaitPolicy, typename MergePolicy, typename Instrumentation,
+                  size_t KeySlots, typename Tracking>
         friend class BloomFilterLock;
         
+        template <size_t>
         friend class _LockRecord;
-        friend class LockIntention;
-        Key(const Key& input, uint8_t prefix_length):
-        m_ui32(input.m_ui32)
+        template <size_t>
+        friend struct BasicLockIntention;
+        constexpr BasicKey(const BasicKey& input, uint8_t prefix_length):
+        m_value(input.m_value)
         {
-            prefix_length = prefix_length <= 3 ? prefix_length : 3;
+            prefix_length = prefix_length <= Slots - 1 ? prefix_length : Slots - 1;
             for(auto i = 0; i < prefix_length; ++i)
             {
-                m_ui8[i] |= 0x80;
+                m_value |= value_type(0x80) << (8 * i);
             }
         }        
-        
-        union
+
+        // Byte i of the key, the slot value in the low 6 bits and the exclusive prefix indicator in the top bit.
+        constexpr uint8_t _byte(size_t i) const
         {
-            uint32_t m_ui32;
-            uint8_t m_ui8[4];
-        };
+            return static_cast<uint8_t>(m_value >> (8 * i));
+        }
+        
+        value_type m_value;
     };
 
+    typedef BasicKey<4> Key;
+    typedef BasicKey<8> WideKey;
+
     
     // Tracks intention to lock a set of resources in a series of bits.    
-    struct LockIntention
+    template <size_t Slots>
+    struct BasicLockIntention
     {
-        LockIntention():
+    /* LockIntention
+     * The read and write bit masks of the key slots are laid out as one block, reads first, so the
+     * compatibility check and merge compile to a couple of vector operations per 4 slots. The exclusive
+     * prefix indicators are packed into one word: bit i is set if slot i of a read key has its exclusive
+     * prefix bit set and bit Slots + i likewise for a write key.
+     * The first max_exact_keys keys are also kept as they are in the padding of the last cache line. A
+     * lock whose merge policy enables exact keys confirms a bit overlap against them before it rejects a
+     * merge, so that small intentions are not kept apart by bloom filter false conflicts. Prefix keys
+     * are not kept, an intention with a prefix key is only checked on its bits.
+     */
+        typedef BasicKey<Slots> KeyType;
+        static constexpr uint32_t slot_mask = (1u << Slots) - 1;
+        static constexpr size_t max_exact_keys = Slots == 4 ? 8 : 6;
+        // m_num_exact_keys once the keys of the intention are no longer known.
+        static constexpr uint8_t exact_keys_unknown = 0xFF;
+        // How a merge settled a bit conflict on the kept keys.
+        enum KeyCheck: uint8_t
+        {
+            // The bits do not conflict.
+            NoConflict = 0,
+            // The keys of one side are not known, the conflict stands.
+            UncheckedConflict = 1,
+            // The kept keys overlap, the conflict is true.
+            KeyConflict = 2,
+            // The kept keys do not overlap, the conflict is a bloom filter false conflict.
+            FalseConflict = 3
+        };
+
+        constexpr BasicLockIntention():
             m_read_indicators(),
             m_write_indicators(),
-            m_exclusive_read_indicators(),
-            m_exclusive_write_indicators(),
             m_min_reads(0),
-            m_min_writes(0)
+            m_min_writes(0),
+            m_exclusive_indicators(0),
+            m_num_exact_keys(0),
+            m_exact_writes(0),
+            m_exact_keys()
         {
             
         }
         
         template<typename T>
-        LockIntention(const T& reads, const T& writes):
-            LockIntention()
+        constexpr BasicLockIntention(const T& reads, const T& writes):
+            BasicLockIntention()
         {
             set(reads, writes);
         }
         
-        LockIntention(const std::initializer_list<Key>& reads, const std::initializer_list<Key>& writes):
-            LockIntention()
+        constexpr BasicLockIntention(const std::initializer_list<KeyType>& reads, const std::initializer_list<KeyType>& writes):
+            BasicLockIntention()
         {
             set(reads, writes);
         }
         
         template<typename T>
-        void set(const T& reads, const T& writes)
+        constexpr void set(const T& reads, const T& writes)
         {
             for(auto key: reads)
-            {
-                if (key.m_ui32 == 0)
-                    continue;
-                
-                m_min_reads += 1;
-                for(auto i = 0; i < 4; ++i)
-                {
-                    m_read_indicators[i] |= (size_t(1) << (key.m_ui8[i] & 0x3F));
-                    if (key.m_ui8[i] & 0x80)
-                        m_exclusive_read_indicators[i] = true;
-                }   
-            }
+                add_read_key(key);
         
             for(auto key: writes)
+                add_write_key(key);
+        }
+
+        constexpr void add_read_key(KeyType key)
+        {
+            if (key.m_value == 0)
+                return;
+            
+            m_min_reads += 1;
+            for(size_t i = 0; i < Slots; ++i)
             {
-                if (key.m_ui32 == 0)
-                    continue;
-                
-                m_min_reads += 1;
-                m_min_writes += 1;
-                for(auto i = 0; i < 4; ++i)
+                m_read_indicators[i] |= (uint64_t(1) << (key._byte(i) & 0x3F));
+                m_exclusive_indicators |= ((key._byte(i) >> 7) << i);
+            }   
+            _add_exact_key(key, false, max_exact_keys);
+        }
+
+        constexpr void add_write_key(KeyType key)
+        {
+            if (key.m_value == 0)
+                return;
+            
+            m_min_reads += 1;
+            m_min_writes += 1;
+            for(size_t i = 0; i < Slots; ++i)
+            {
+                m_write_indicators[i] |= (uint64_t(1) << (key._byte(i) & 0x3F));
+                m_read_indicators[i] |= (uint64_t(1) << (key._byte(i) & 0x3F));
+                m_exclusive_indicators |= ((key._byte(i) >> 7) * (((1u << Slots) | 1u) << i));
+            }
+            _add_exact_key(key, true, max_exact_keys);
+        }
+
+        constexpr void _add_exact_key(KeyType key, bool write, size_t exact_keys)
+        {
+            if (m_num_exact_keys >= std::min(exact_keys, max_exact_keys) ||
+                (key.m_value & typename KeyType::value_type(0x8080808080808080ull)))
+            {
+                m_num_exact_keys = exact_keys_unknown;
+                return;
+            }
+            m_exact_writes |= uint8_t(write) << m_num_exact_keys;
+            m_exact_keys[m_num_exact_keys++] = key.m_value;
+        }
+
+        /* Settles a bit conflict on the kept keys: returns true if they were checked and show the conflict
+         * to be false, and reports the outcome in check.
+         */
+        static bool _settle_conflict(bool checked, bool compatible, KeyCheck* check)
+        {
+            if (check)
+                *check = not checked ? UncheckedConflict : compatible ? FalseConflict : KeyConflict;
+            return compatible;
+        }
+
+        // Returns true if the kept keys show that key, read or written, is not written by this intention
+        // nor written while it is read.
+        bool _exact_compatible(KeyType key, bool write) const
+        {
+            if (m_num_exact_keys == exact_keys_unknown)
+                return false;
+
+            for(size_t i = 0; i < m_num_exact_keys; ++i)
+            {
+                if (m_exact_keys[i] == key.m_value && (write || ((m_exact_writes >> i) & 1)))
+                    return false;
+            }
+            return true;
+        }
+
+        /* Adds a write on key for a request which reads key if reads is set. Returns false unless the kept
+         * keys show that no other request reads or writes key, i.e. that the only kept read of key is the
+         * one of the request, if any.
+         */
+        bool _upgrade_exact_key(KeyType key, bool reads)
+        {
+            if (m_num_exact_keys == exact_keys_unknown || (key.m_value & typename KeyType::value_type(0x8080808080808080ull)))
+                return false;
+
+            size_t found = m_num_exact_keys;
+            for(size_t i = 0; i < m_num_exact_keys; ++i)
+            {
+                if (m_exact_keys[i] == key.m_value)
                 {
-                    m_write_indicators[i] |= (size_t(1) << (key.m_ui8[i] & 0x3F));
-                    m_read_indicators[i] |= (size_t(1) << (key.m_ui8[i] & 0x3F));
-                    if (key.m_ui8[i] & 0x80)
-                    {
-                        m_exclusive_read_indicators[i] = true;
-                        m_exclusive_write_indicators[i] = true;
-                    }
+                    if (not reads || found != m_num_exact_keys || ((m_exact_writes >> i) & 1))
+                        return false;
+                    found = i;
                 }
-            }            
+            }
+            if (reads != (found != m_num_exact_keys))
+                return false;
+            if (found == m_num_exact_keys)
+            {
+                if (m_num_exact_keys == max_exact_keys)
+                    return false;
+                m_exact_keys[m_num_exact_keys++] = key.m_value;
+                m_min_reads += 1;
+            }
+
+            m_exact_writes |= uint8_t(1) << found;
+            m_min_writes += 1;
+            for(size_t i = 0; i < Slots; ++i)
+            {
+                m_write_indicators[i] |= (uint64_t(1) << (key._byte(i) & 0x3F));
+                m_read_indicators[i] |= (uint64_t(1) << (key._byte(i) & 0x3F));
+            }
+            return true;
+        }
+
+        // Returns true if the kept keys include key, read only unless write is set.
+        bool _keeps_key(KeyType key, bool write) const
+        {
+            return _find_exact_key(key, write) != m_num_exact_keys;
+        }
+
+        // Returns the index of the first kept key equal to key, read only unless write is set, or
+        // m_num_exact_keys.
+        size_t _find_exact_key(KeyType key, bool write) const
+        {
+            if (m_num_exact_keys == exact_keys_unknown)
+                return m_num_exact_keys;
+
+            for(size_t i = 0; i < m_num_exact_keys; ++i)
+            {
+                if (m_exact_keys[i] == key.m_value && ((m_exact_writes >> i) & 1) == write)
+                    return i;
+            }
+            return m_num_exact_keys;
+        }
+
+        // Turns one kept read of key into a write. Returns false if key is not kept as a read.
+        bool _flip_exact_key(KeyType key)
+        {
+            size_t found = _find_exact_key(key, false);
+            if (found == m_num_exact_keys)
+                return false;
+
+            m_exact_writes |= uint8_t(1) << found;
+            m_min_writes += 1;
+            for(size_t i = 0; i < Slots; ++i)
+                m_write_indicators[i] |= (uint64_t(1) << (key._byte(i) & 0x3F));
+            return true;
+        }
+
+        // Drops one kept key equal to key in the given mode from the kept keys only, the bits are left as
+        // they are. Returns false if there is no such key.
+        bool _remove_exact_key(KeyType key, bool write)
+        {
+            size_t found = _find_exact_key(key, write);
+            if (found == m_num_exact_keys)
+                return false;
+
+            for(size_t i = found + 1; i < m_num_exact_keys; ++i)
+                m_exact_keys[i - 1] = m_exact_keys[i];
+            uint8_t below = uint8_t((1u << found) - 1);
+            m_exact_writes = uint8_t((m_exact_writes & below) | ((m_exact_writes >> 1) & ~below));
+            --m_num_exact_keys;
+            return true;
+        }
+
+        /* Gives back the keys of part, which must each be kept by this intention in the same mode, and
+         * rebuilds the bits from the keys that are left. Returns false and leaves this intention as it is
+         * if the keys of either are not known or part is not a subset of them.
+         */
+        bool _release_exact_keys(const BasicLockIntention& part)
+        {
+            if (part.m_num_exact_keys == exact_keys_unknown)
+                return false;
+
+            BasicLockIntention left(*this);
+            for(size_t k = 0; k < part.m_num_exact_keys; ++k)
+            {
+                if (not left._remove_exact_key(KeyType(part.m_exact_keys[k]), (part.m_exact_writes >> k) & 1))
+                    return false;
+            }
+            clear();
+            for(size_t k = 0; k < left.m_num_exact_keys; ++k)
+            {
+                if ((left.m_exact_writes >> k) & 1)
+                    add_write_key(KeyType(left.m_exact_keys[k]));
+                else
+                    add_read_key(KeyType(left.m_exact_keys[k]));
+            }
+            return true;
+        }
+
+        // Returns true if every bit of rhs is set in this intention.
+        bool _contains(const BasicLockIntention& rhs) const
+        {
+            if ((rhs.m_exclusive_indicators & ~m_exclusive_indicators) || rhs.m_min_writes > m_min_writes)
+                return false;
+
+            for(size_t i = 0; i < Slots; ++i)
+            {
+                if ((rhs.m_read_indicators[i] & ~m_read_indicators[i]) || (rhs.m_write_indicators[i] & ~m_write_indicators[i]))
+                    return false;
+            }
+            return true;
+        }
+
+        bool _exact_compatible(const BasicLockIntention& rhs) const
+        {
+            if (rhs.m_num_exact_keys == exact_keys_unknown)
+                return false;
+
+            for(size_t i = 0; i < rhs.m_num_exact_keys; ++i)
+            {
+                if (not _exact_compatible(KeyType(rhs.m_exact_keys[i]), (rhs.m_exact_writes >> i) & 1))
+                    return false;
+            }
+            return true;
         }
         
-        LockIntention(const LockIntention& rhs) = default;
+        BasicLockIntention(const BasicLockIntention& rhs) = default;
         
         void clear()
         {
-            for(auto i = 0; i < 4; ++i)
-            {
-                m_read_indicators[i] = 0;
-                m_write_indicators[i] = 0;
-                m_exclusive_read_indicators[i] = false;
-                m_exclusive_write_indicators[i] = false;
-                m_min_reads = 0;
-                m_min_writes = 0;
-            }    
+            *this = BasicLockIntention();
         }
-                       
-        bool _prefix_compatibility_check(const size_t lhs_bits[4], const bool lhs_exclusive_indicators[4], 
-                                         const size_t rhs_bits[4], const bool rhs_exclusive_indicators[4])
-        {            
-            bool prefix_check_enabled = lhs_exclusive_indicators[0] || rhs_exclusive_indicators[0];
-            
-            for(auto i = 0; i < 4; ++i)
+
+        uint32_t exclusive_read_indicators() const {return m_exclusive_indicators & slot_mask;}
+        uint32_t exclusive_write_indicators() const {return m_exclusive_indicators >> Slots;}
+
+        // Returns a mask with bit i set if slot i of lhs and rhs have no bits in common.
+        static uint32_t _zero_overlap_mask(const uint64_t lhs_bits[Slots], const uint64_t rhs_bits[Slots])
+        {
+            uint32_t mask = 0;
+#if defined(__AVX2__)
+            for(size_t i = 0; i < Slots; i += 4)
             {
-                if (not (lhs_bits[i] & rhs_bits[i]))
-                {
-                    if (not prefix_check_enabled)
-                        return true;
-                
-                    if (lhs_exclusive_indicators[i] || rhs_exclusive_indicators[i])
-                        return true;
-                    
-                    // There's a non-empty prefix match between the lhs and rhs ending at index i - 1
-                    // which indicates merge incompatibility.
-                    return false;
-                }
-                    
-                if (prefix_check_enabled)
-                {
-                    if (i > 0 && (not rhs_exclusive_indicators[i] && rhs_exclusive_indicators[i-1]))
-                        return false;
-                    
-                    if (i > 0 && (not lhs_exclusive_indicators[i] and lhs_exclusive_indicators[i-1]))
-                        return false;                    
-                }            
+                __m256i overlap = _mm256_and_si256(_mm256_load_si256(reinterpret_cast<const __m256i*>(lhs_bits + i)),
+                                                   _mm256_load_si256(reinterpret_cast<const __m256i*>(rhs_bits + i)));
+                __m256i zero = _mm256_cmpeq_epi64(overlap, _mm256_setzero_si256());
+                mask |= uint32_t(_mm256_movemask_pd(_mm256_castsi256_pd(zero))) << i;
             }
-            return false;
+#elif defined(__SSE4_1__)
+            for(size_t i = 0; i < Slots; i += 2)
+            {
+                __m128i overlap = _mm_and_si128(_mm_load_si128(reinterpret_cast<const __m128i*>(lhs_bits + i)),
+                                                _mm_load_si128(reinterpret_cast<const __m128i*>(rhs_bits + i)));
+                mask |= uint32_t(_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(overlap, _mm_setzero_si128())))) << i;
+            }
+#elif defined(__SSE2__)
+            for(size_t i = 0; i < Slots; i += 2)
+            {
+                // SSE2 has no 64 bit compare, a slot is zero if both of its 32 bit halves are.
+                __m128i overlap = _mm_and_si128(_mm_load_si128(reinterpret_cast<const __m128i*>(lhs_bits + i)),
+                                                _mm_load_si128(reinterpret_cast<const __m128i*>(rhs_bits + i)));
+                __m128i zero = _mm_cmpeq_epi32(overlap, _mm_setzero_si128());
+                zero = _mm_and_si128(zero, _mm_shuffle_epi32(zero, 0xB1));
+                mask |= uint32_t(_mm_movemask_pd(_mm_castsi128_pd(zero))) << i;
+            }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+            for(size_t i = 0; i < Slots; i += 2)
+            {
+                uint64x2_t zero = vceqzq_u64(vandq_u64(vld1q_u64(lhs_bits + i), vld1q_u64(rhs_bits + i)));
+                mask |= uint32_t((vgetq_lane_u64(zero, 0) & 1) | (vgetq_lane_u64(zero, 1) & 2)) << i;
+            }
+#else
+            for(size_t i = 0; i < Slots; ++i)
+                mask |= uint32_t((lhs_bits[i] & rhs_bits[i]) == 0) << i;
+#endif
+            return mask;
+        }
+                       
+        static bool _prefix_compatibility_check(uint32_t zero_overlap, uint32_t lhs_exclusive_indicators,
+                                                uint32_t rhs_exclusive_indicators)
+        {
+            // Compatible once a slot without overlap is found. If either side has exclusive prefixes the
+            // slots before it must be fully prefixed on both sides, i.e. a falling edge in the exclusive
+            // indicators ahead of the slot is an incompatible prefix match, and the slot itself must be
+            // marked exclusive on at least one side.
+            if (not zero_overlap)
+                return false;
+
+            if (not ((lhs_exclusive_indicators | rhs_exclusive_indicators) & 1))
+                return true;
+
+            uint32_t first = __builtin_ctz(zero_overlap);
+            uint32_t falling_edges = (lhs_exclusive_indicators & ~(lhs_exclusive_indicators >> 1)) |
+                                     (rhs_exclusive_indicators & ~(rhs_exclusive_indicators >> 1));
+            if (falling_edges & (((1u << first) - 1) >> 1))
+                return false;
+
+            return ((lhs_exclusive_indicators | rhs_exclusive_indicators) >> first) & 1;
         }
+
+        static bool _prefix_compatibility_check(const uint64_t lhs_bits[Slots], uint32_t lhs_exclusive_indicators, 
+                                                const uint64_t rhs_bits[Slots], uint32_t rhs_exclusive_indicators)
+        {
+            return _prefix_compatibility_check(_zero_overlap_mask(lhs_bits, rhs_bits), lhs_exclusive_indicators,
+                                               rhs_exclusive_indicators);
+        }
+
+        // Single key versions of the above, the key bits are tested in place.
+        static uint32_t _zero_overlap_mask(const uint64_t lhs_bits[Slots], KeyType key)
+        {
+            uint32_t mask = 0;
+            for(size_t i = 0; i < Slots; ++i)
+                mask |= uint32_t(((lhs_bits[i] >> (key._byte(i) & 0x3F)) & 1) ^ 1) << i;
+            return mask;
+        }
+
+        static uint32_t _exclusive_indicators(KeyType key)
+        {
+            uint32_t mask = 0;
+            for(size_t i = 0; i < Slots; ++i)
+                mask |= uint32_t(key._byte(i) >> 7) << i;
+            return mask;
+        }
+        
         
+        // Returns true if the passed in lock intention can be held concurrently with this one.
+        bool compatible(const BasicLockIntention& rhs) const
+        {
+            if (not(m_min_reads || m_min_writes))
+                return true;
+
+            return _prefix_compatibility_check(m_write_indicators, exclusive_write_indicators(),
+                                               rhs.m_read_indicators, rhs.exclusive_read_indicators()) &&
+                   _prefix_compatibility_check(m_read_indicators, exclusive_read_indicators(),
+                                               rhs.m_write_indicators, rhs.exclusive_write_indicators());
+        }
         
-        bool merge(const LockIntention& rhs)
+        /* Returns true if the passed in lock intention was successfully merged into this one.
+         * With exact_keys > 0 a bit conflict is confirmed against the kept keys of both sides, which this
+         * intention keeps for as long as it has no more than exact_keys keys. check, if passed, is set to how
+         * a bit conflict was settled on the kept keys and left alone if the bits do not conflict.
+         */
+        bool merge(const BasicLockIntention& rhs, size_t exact_keys = 0, KeyCheck* check = nullptr)
         {
             // Merging with self is an error.
             if (&rhs == this)
@@ -220,98 +578,291 @@ namespace bloomfilter_lock
                 return true;
             }
             
-            // Returns true if the passed in lock intention was successfully merged into this one.
-            if (not (_prefix_compatibility_check(m_write_indicators, m_exclusive_write_indicators,
-                    rhs.m_read_indicators, rhs.m_exclusive_read_indicators)))
-                return false;
-                
-            if (not _prefix_compatibility_check(m_read_indicators, m_exclusive_read_indicators,
-                    rhs.m_write_indicators, rhs.m_exclusive_write_indicators))
-                return false;
+            if (not compatible(rhs))
+            {
+                bool checked = exact_keys && m_num_exact_keys != exact_keys_unknown &&
+                               rhs.m_num_exact_keys != exact_keys_unknown;
+                if (not _settle_conflict(checked, checked && _exact_compatible(rhs), check))
+                    return false;
+            }
             
-            for(auto i = 0; i < 4; ++i)
+#if defined(__AVX2__)
+            for(size_t i = 0; i < 2 * Slots; i += 4)
             {
-                m_write_indicators[i] |= rhs.m_write_indicators[i];
-                m_read_indicators[i] |= rhs.m_read_indicators[i];
-                if (rhs.m_exclusive_read_indicators[0])
-                    m_exclusive_read_indicators[i] = (m_exclusive_read_indicators[i] && rhs.m_exclusive_read_indicators[i]);
-                
-                if (rhs.m_exclusive_write_indicators[0])
-                    m_exclusive_write_indicators[i] = (m_exclusive_write_indicators[i] && rhs.m_exclusive_write_indicators[i]);
+                auto lhs_bits = reinterpret_cast<__m256i*>(m_read_indicators + i);
+                auto rhs_bits = reinterpret_cast<const __m256i*>(rhs.m_read_indicators + i);
+                _mm256_store_si256(lhs_bits, _mm256_or_si256(_mm256_load_si256(lhs_bits), _mm256_load_si256(rhs_bits)));
             }
+#elif defined(__SSE2__)
+            for(size_t i = 0; i < 2 * Slots; i += 2)
+            {
+                auto lhs_bits = reinterpret_cast<__m128i*>(m_read_indicators + i);
+                auto rhs_bits = reinterpret_cast<const __m128i*>(rhs.m_read_indicators + i);
+                _mm_store_si128(lhs_bits, _mm_or_si128(_mm_load_si128(lhs_bits), _mm_load_si128(rhs_bits)));
+            }
+#elif defined(__ARM_NEON)
+            for(size_t i = 0; i < 2 * Slots; i += 2)
+                vst1q_u64(m_read_indicators + i, vorrq_u64(vld1q_u64(m_read_indicators + i),
+                                                           vld1q_u64(rhs.m_read_indicators + i)));
+#else
+            for(size_t i = 0; i < 2 * Slots; ++i)
+                m_read_indicators[i] |= rhs.m_read_indicators[i];
+#endif
+
+            // If rhs has an exclusive prefix the merged prefix is the one common to both sides.
+            uint32_t common_prefix = ((rhs.m_exclusive_indicators & 1) ? slot_mask : 0) |
+                                     ((rhs.m_exclusive_indicators & (1u << Slots)) ? slot_mask << Slots : 0);
+            m_exclusive_indicators &= (rhs.m_exclusive_indicators | ~common_prefix);
             m_min_reads += rhs.m_min_reads;
             m_min_writes += rhs.m_min_writes;
+
+            if (m_num_exact_keys + rhs.m_num_exact_keys <= std::min(exact_keys, max_exact_keys))
+            {
+                m_exact_writes |= rhs.m_exact_writes << m_num_exact_keys;
+                std::copy(rhs.m_exact_keys, rhs.m_exact_keys + rhs.m_num_exact_keys, m_exact_keys + m_num_exact_keys);
+                m_num_exact_keys += rhs.m_num_exact_keys;
+            }
+            else
+            {
+                m_num_exact_keys = exact_keys_unknown;
+            }
             return true;
         }
         
-        static LockIntention from_read_key(Key key)
+        // Equivalent to merge(from_read_key(key), exact_keys, check) without building the intention.
+        bool merge_read_key(KeyType key, size_t exact_keys = 0, KeyCheck* check = nullptr)
+        {
+            if (not(m_min_reads || m_min_writes))
+            {
+                add_read_key(key);
+                return true;
+            }
+
+            if (key.m_value == 0)
+                return true;
+
+            uint32_t key_exclusive = _exclusive_indicators(key);
+            if (not _prefix_compatibility_check(_zero_overlap_mask(m_write_indicators, key),
+                                                exclusive_write_indicators(), key_exclusive))
+            {
+                bool checked = exact_keys && not key_exclusive && m_num_exact_keys != exact_keys_unknown;
+                if (not _settle_conflict(checked, checked && _exact_compatible(key, false), check))
+                    return false;
+            }
+
+            for(size_t i = 0; i < Slots; ++i)
+                m_read_indicators[i] |= (uint64_t(1) << (key._byte(i) & 0x3F));
+            if (key_exclusive & 1)
+                m_exclusive_indicators &= (key_exclusive | (slot_mask << Slots));
+            m_min_reads += 1;
+            _add_exact_key(key, false, exact_keys);
+            return true;
+        }
+
+        // Equivalent to merge(from_write_key(key), exact_keys, check) without building the intention.
+        bool merge_write_key(KeyType key, size_t exact_keys = 0, KeyCheck* check = nullptr)
         {
-            return LockIntention({key}, {Key(0)});            
+            if (not(m_min_reads || m_min_writes))
+            {
+                add_write_key(key);
+                return true;
+            }
+
+            if (key.m_value == 0)
+                return true;
+
+            uint32_t key_exclusive = _exclusive_indicators(key);
+            if (not _prefix_compatibility_check(_zero_overlap_mask(m_write_indicators, key),
+                                                exclusive_write_indicators(), key_exclusive) ||
+                not _prefix_compatibility_check(_zero_overlap_mask(m_read_indicators, key),
+                                                exclusive_read_indicators(), key_exclusive))
+            {
+                bool checked = exact_keys && not key_exclusive && m_num_exact_keys != exact_keys_unknown;
+                if (not _settle_conflict(checked, checked && _exact_compatible(key, true), check))
+                    return false;
+            }
+
+            for(size_t i = 0; i < Slots; ++i)
+            {
+                m_write_indicators[i] |= (uint64_t(1) << (key._byte(i) & 0x3F));
+                m_read_indicators[i] |= (uint64_t(1) << (key._byte(i) & 0x3F));
+            }
+            if (key_exclusive & 1)
+                m_exclusive_indicators &= (key_exclusive | (key_exclusive << Slots));
+            m_min_reads += 1;
+            m_min_writes += 1;
+            _add_exact_key(key, true, exact_keys);
+            return true;
         }
         
-        static LockIntention from_write_key(Key key)
+        static constexpr BasicLockIntention from_read_key(KeyType key)
         {
-            return LockIntention({Key(0)}, {key});
+            return BasicLockIntention({key}, {KeyType(0)});            
         }
-                
-        size_t m_read_indicators[4];
-        size_t m_write_indicators[4];
-        bool m_exclusive_read_indicators[4];
-        bool m_exclusive_write_indicators[4];
+        
+        static constexpr BasicLockIntention from_write_key(KeyType key)
+        {
+            return BasicLockIntention({KeyType(0)}, {key});
+        }
+        
+        // m_write_indicators must directly follow m_read_indicators.
+        alignas(_cache_line_size) uint64_t m_read_indicators[Slots];
+        uint64_t m_write_indicators[Slots];
         
         // Min read and write counts based on number of keys at construction time.
         // merge adds values from merged element. Note that these are min bounds. The total number of
         // intended reads and writes can be higher
-        size_t m_min_reads;
-        size_t m_min_writes;
+        uint32_t m_min_reads;
+        uint32_t m_min_writes;
+        uint16_t m_exclusive_indicators;
+
+        // Number of kept keys or exact_keys_unknown, bit i of m_exact_writes is set if key i is written.
+        uint8_t m_num_exact_keys;
+        uint8_t m_exact_writes;
+        typename KeyType::value_type m_exact_keys[max_exact_keys];
     };
+
+    static_assert(sizeof(BasicLockIntention<4>) == 2 * _cache_line_size &&
+                  sizeof(BasicLockIntention<8>) == 3 * _cache_line_size, "Kept keys must fit the intention padding");
+
+    typedef BasicLockIntention<4> LockIntention;
+    typedef BasicLockIntention<8> WideLockIntention;
+
+
+    /* make_intention:
+     * Builds the intention to read the keys with the values Reads and write writes. The keys are of the
+     * type of the writes, Key if there are none. In a constant expression the indicator masks are computed
+     * at compile time, a fixed key combination can then be locked without building its intention:
+     *     static constexpr auto intention = make_intention<0x01020304>(Key(0x05060708));
+     *     lock.multilock(intention);
+     * multilock and the other functions taking an intention take it by reference, it is never copied.
+     */
+    template <uint64_t... Reads, typename... Writes>
+    constexpr auto make_intention(Writes... writes)
+    {
+        typedef std::tuple_element_t<0, std::tuple<Writes..., Key>> KeyType;
+        static_assert((std::is_same<Writes, KeyType>::value && ...), "Writes must all be keys of the same width");
+        BasicLockIntention<KeyType::num_slots> intention;
+        (intention.add_read_key(KeyType(static_cast<typename KeyType::value_type>(Reads))), ...);
+        (intention.add_write_key(writes), ...);
+        return intention;
+    }
     
     
-    struct _FutexWrapper
+    inline void _cpu_relax()
+    {
+        // Hint to the cpu that the caller is in a spin-wait loop.
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        asm volatile("yield" ::: "memory");
+#else
+        std::this_thread::yield();
+#endif
+    }
+
+
+    template <bool ProcessShared>
+    struct _BasicFutexWrapper
     {
-    /* _FutexWrapper
+    /* _BasicFutexWrapper
      * Wrapper around the FUTEX_WAIT and FUTEX_WAKE system calls. Will be
      * switched to the wrappers in boost.sync when c++ modules are available.
+     * The futex word is 0 while unsignalled, 2 while unsignalled with at least one
+     * thread parked on it and 1 once signalled. signal only issues FUTEX_WAKE if
+     * a thread may actually be parked. A ProcessShared futex uses the non-private
+     * operations, which key the futex by its physical page, so it can be waited on
+     * and signalled from every process mapping it.
      */
-        _FutexWrapper():
-            m_futex(0) {}
+        enum State : int32_t
+        {
+            Unsignalled = 0,
+            Signalled = 1,
+            Parked = 2
+        };
+
+        _BasicFutexWrapper():
+            m_futex(Unsignalled) {}
     
         void reset()
         {
-            m_futex = 0;
+            m_futex.store(Unsignalled, std::memory_order_relaxed);
+        }
+
+        bool signalled() const
+        {
+            return m_futex.load(std::memory_order_acquire) == Signalled;
         }
         
-        void wait()
+        // Returns true if the caller had to park in FUTEX_WAIT.
+        bool wait()
         {
-            while(1)
+            int32_t state = Unsignalled;
+            if (not m_futex.compare_exchange_strong(state, Parked, std::memory_order_acquire) && state == Signalled)
+                return false;
+
+            bool parked = false;
+            while(m_futex.load(std::memory_order_acquire) != Signalled)
             {
-                int result = syscall(SYS_futex, &m_futex, FUTEX_WAIT_PRIVATE, 0, 0, 0, 0);
-                if (result == 0 && m_futex == 1)
-                    break;
-                
-                if (result == -1)
+                parked = true;
+                int result = syscall(SYS_futex, &m_futex, WaitOp, Parked, 0, 0, 0);
+                if (result == -1 && errno != EAGAIN && errno != EINTR)
                 {
-                    if (errno == EAGAIN)
-                    {
-                        if (m_futex == 1)
-                            break;
-                        continue;
-                    }
                     std::cerr << "Unexpected errno " << errno << " from futex_wait" << std::endl;
                     std::terminate();
                 }                
             }
+            return parked;
         }
-        
-        void signal()
-        {            
-            int result = -1;            
+
+        // Returns false if the deadline passed before the futex was signalled.
+        bool wait_until(std::chrono::steady_clock::time_point deadline)
+        {
+            int32_t state = Unsignalled;
+            if (not m_futex.compare_exchange_strong(state, Parked, std::memory_order_acquire) && state == Signalled)
+                return true;
+
+            while(m_futex.load(std::memory_order_acquire) != Signalled)
+            {
+                // FUTEX_WAIT takes a timeout relative to CLOCK_MONOTONIC, as is steady_clock.
+                auto remaining = deadline - std::chrono::steady_clock::now();
+                if (remaining <= std::chrono::steady_clock::duration::zero())
+                    return false;
+
+                auto seconds = std::chrono::duration_cast<std::chrono::seconds>(remaining);
+                auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(remaining - seconds);
+                timespec timeout{static_cast<time_t>(seconds.count()), static_cast<long>(nanoseconds.count())};
+                int result = syscall(SYS_futex, &m_futex, WaitOp, Parked, &timeout, 0, 0);
+                if (result == -1 && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT)
+                {
+                    std::cerr << "Unexpected errno " << errno << " from futex_wait" << std::endl;
+                    std::terminate();
+                }
+            }
+            return true;
+        }
+        
+        void signal()
+        {            
+            if (set_signalled())
+                wake(INT_MAX);
+        }
+
+        // Signals the futex without waking anybody. Returns true if a thread may be parked on it, which
+        // the caller then has to wake.
+        bool set_signalled()
+        {
+            return m_futex.exchange(Signalled, std::memory_order_release) == Parked;
+        }
+
+        // Wakes up to count threads parked on the futex and returns the number woken.
+        int wake(int count)
+        {
             while(1)
             {
-                m_futex = 1;
-                result = syscall(SYS_futex, &m_futex, FUTEX_WAKE_PRIVATE, INT_MAX, 0, 0, 0);
+                int result = syscall(SYS_futex, &m_futex, WakeOp, count, 0, 0, 0);
                 if (result >= 0)
-                    return;
+                    return result;
                 if (result == -1 && errno == EAGAIN)
                 {
                     errno = 0;
@@ -322,16 +873,147 @@ namespace bloomfilter_lock
             }
         }
         
-        int32_t m_futex;
+        static constexpr int WaitOp = ProcessShared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE;
+        static constexpr int WakeOp = ProcessShared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE;
+        std::atomic<int32_t> m_futex;
+    };
+
+    typedef _BasicFutexWrapper<false> _FutexWrapper;
+
+
+    struct FutexWaitPolicy
+    {
+    /* FutexWaitPolicy
+     * Parks a waiter on the record futex as soon as it finds the record inactive. This is the
+     * best choice when lock hold times are long compared to the cost of a FUTEX_WAIT/FUTEX_WAKE pair.
+     */
+        bool wait(_FutexWrapper& futex)
+        {
+            return futex.wait();
+        }
+
+        bool wait_until(_FutexWrapper& futex, std::chrono::steady_clock::time_point deadline)
+        {
+            return futex.wait_until(deadline);
+        }
+    };
+
+
+    template <uint32_t MinSpins = 16, uint32_t MaxSpins = 4096>
+    class AdaptiveSpinWaitPolicy
+    {
+    /* AdaptiveSpinWaitPolicy
+     * Spins on the record futex word for a bounded number of iterations before parking on the futex.
+     * The spin bound tracks the number of iterations recent waits needed to see the record activated:
+     * it grows towards twice the observed wait when spinning succeeds and decays when a waiter has to
+     * park anyway. Suited to short critical sections where the syscall costs more than the lock hold.
+     */
+    public:
+        AdaptiveSpinWaitPolicy():
+            m_spin_limit(MinSpins)
+        {}
+
+        bool wait(_FutexWrapper& futex)
+        {
+            int64_t limit = m_spin_limit.load(std::memory_order_relaxed);
+            for (int64_t i = 0; i < limit; ++i)
+            {
+                if (futex.signalled())
+                {
+                    _update(limit, limit + (2 * i - limit) / 8);
+                    return false;
+                }
+                _cpu_relax();
+            }
+
+            _update(limit, limit - limit / 8);
+            return futex.wait();
+        }
+
+        bool wait_until(_FutexWrapper& futex, std::chrono::steady_clock::time_point deadline)
+        {
+            // The spin is short enough not to check the deadline.
+            int64_t limit = m_spin_limit.load(std::memory_order_relaxed);
+            for (int64_t i = 0; i < limit; ++i)
+            {
+                if (futex.signalled())
+                {
+                    _update(limit, limit + (2 * i - limit) / 8);
+                    return true;
+                }
+                _cpu_relax();
+            }
+
+            _update(limit, limit - limit / 8);
+            return futex.wait_until(deadline);
+        }
+
+    private:
+        void _update(int64_t limit, int64_t new_limit)
+        {
+            new_limit = std::min<int64_t>(std::max<int64_t>(new_limit, MinSpins), MaxSpins);
+            // Only write when the bound moves to avoid dirtying the shared line on every wait.
+            if (new_limit != limit)
+                m_spin_limit.store(static_cast<uint32_t>(new_limit), std::memory_order_relaxed);
+        }
+
+        std::atomic<uint32_t> m_spin_limit;
     };
 
+
+    template <int Fanout = 4>
+    struct ChainedWakeWaitPolicy
+    {
+    /* ChainedWakeWaitPolicy
+     * Parks like FutexWaitPolicy, but the activation of a record only wakes Fanout of its parked
+     * waiters and every woken waiter wakes up to Fanout more before it enters the critical section.
+     * Large batches are then woken in a tree instead of by a single FUTEX_WAKE, which keeps the
+     * releasing thread from paying for the wake of every member of the next batch.
+     */
+        static constexpr int wake_fanout = Fanout;
+
+        bool wait(_FutexWrapper& futex)
+        {
+            bool parked = futex.wait();
+            if (parked)
+                futex.wake(Fanout);
+            return parked;
+        }
+
+        bool wait_until(_FutexWrapper& futex, std::chrono::steady_clock::time_point deadline)
+        {
+            if (futex.signalled())
+                return true;
+            if (not futex.wait_until(deadline))
+                return false;
+            futex.wake(Fanout);
+            return true;
+        }
+    };
+
+
+    // Number of parked waiters woken by the activation of a record, the wake_fanout of the wait policy if it
+    // chains wakes.
+    template <typename WaitPolicy, typename = void>
+    struct _wake_fanout: std::integral_constant<int, INT_MAX> {};
+
+    template <typename WaitPolicy>
+    struct _wake_fanout<WaitPolicy, std::void_t<decltype(WaitPolicy::wake_fanout)>>:
+        std::integral_constant<int, WaitPolicy::wake_fanout> {};
+
         
-    class _SpinLock
+
+
+    class alignas(_cache_line_size) _SpinLock
     {
     /* _SpinLock
-     * Simple spin lock based on c++ atomics. The boost.sync library has
-     * similar functionality. The will be switched to the boost.sync version
-     * when c++ modules functionality is widely available.
+     * Test-and-test-and-set spin lock with exponential backoff based on c++ atomics. Waiters spin on
+     * a relaxed load so the line stays shared until the holder releases it, and back off between
+     * attempts so an unlock is not followed by every waiter writing the line at once. Once the
+     * backoff saturates waiters yield the cpu to cope with preempted holders. The lock occupies a
+     * full cache line so it never false-shares with neighbouring fields. The boost.sync library has
+     * similar functionality. The will be switched to the boost.sync version when c++ modules
+     * functionality is widely available.
      */
     public:
         _SpinLock():
@@ -340,29 +1022,204 @@ namespace bloomfilter_lock
         
         void lock()
         {
-            bool locked = false;
-            while(!m_lock.compare_exchange_weak(locked, true, std::memory_order_acquire))
+            uint32_t backoff = 1;
+            while(m_lock.exchange(true, std::memory_order_acquire))
             {
-                locked = false;
+                do
+                {
+                    for (uint32_t i = 0; i < backoff; ++i)
+                        _cpu_relax();
+
+                    if (backoff < MaxBackoff)
+                        backoff <<= 1;
+                    else
+                        std::this_thread::yield();
+                } while (m_lock.load(std::memory_order_relaxed));
             }
         }
 
+        bool try_lock()
+        {
+            return not m_lock.load(std::memory_order_relaxed) && 
+                   not m_lock.exchange(true, std::memory_order_acquire);
+        }
+
         void unlock()
         {
             m_lock.store(false, std::memory_order_release);
         }
         private:
+            static constexpr uint32_t MaxBackoff = 1024;
             std::atomic<bool> m_lock;
     };    
 
 
-    class _LockRecord
+    class alignas(_cache_line_size) _TicketSpinLock
     {
-    /* LockRecord:
-     * The main structure used to track the series of resources to be locked in a locking batch via a BloomFilterLock
+    /* _TicketSpinLock
+     * FIFO fair spin lock. Each locker takes a ticket and waits for it to be served, backing off in
+     * proportion to its distance from the head of the line. Prefer _SpinLock unless starvation of
+     * individual threads on the internal lock has been observed as the ticket lock degrades badly
+     * when the next ticket holder is preempted.
      */
     public:
+        _TicketSpinLock():
+        m_next(0),
+        m_serving(0)
+        {}
+
+        void lock()
+        {
+            uint32_t ticket = m_next.fetch_add(1, std::memory_order_relaxed);
+            uint32_t spins = 0;
+            while(1)
+            {
+                uint32_t serving = m_serving.load(std::memory_order_acquire);
+                if (serving == ticket)
+                    return;
+
+                for (uint32_t i = 0, n = (ticket - serving) * BackoffUnit; i < n; ++i)
+                    _cpu_relax();
+
+                if (++spins > MaxSpins)
+                    std::this_thread::yield();
+            }
+        }
+
+        bool try_lock()
+        {
+            uint32_t serving = m_serving.load(std::memory_order_relaxed);
+            return m_next.compare_exchange_strong(serving, serving + 1, std::memory_order_acquire);
+        }
+
+        void unlock()
+        {
+            m_serving.store(m_serving.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+    private:
+        static constexpr uint32_t BackoffUnit = 32;
+        static constexpr uint32_t MaxSpins = 256;
+        std::atomic<uint32_t> m_next;
+        std::atomic<uint32_t> m_serving;
+    };
+
+
+    struct _AsyncWaiter
+    {
+    /* _AsyncWaiter
+     * Intrusive node for a request which continues asynchronously once its lock record is activated
+     * instead of parking its thread on the record futex. Owned by the request: m_resume is called
+     * once, outside all internal locks, and may free the node. A node without m_resume is the
+     * _FutexWake of a lock record.
+     */
+        _AsyncWaiter* m_next;
+        void (*m_resume)(_AsyncWaiter* self);
+
+        static void resume_all(_AsyncWaiter* waiters);
+    };
+
+
+    struct _FutexWake: _AsyncWaiter
+    {
+    /* _FutexWake
+     * The FUTEX_WAKE owed to the threads parked on a lock record. It is handed out by the activation
+     * of the record along with the asynchronous waiters so the syscall is issued once the activating
+     * thread has released the mutex of the BloomFilterLock and the record spin lock. m_pending keeps
+     * the record from being cleared while the wake is in flight. m_trace is set by the activation of
+     * locks whose instrumentation traces, see UsdtInstrumentation::trace_wake.
+     */
+        _FutexWake(_FutexWrapper& futex, const void* record):
+            _AsyncWaiter{nullptr, nullptr},
+            m_futex(futex),
+            m_fanout(INT_MAX),
+            m_pending(false),
+            m_record(record),
+            m_trace(nullptr),
+            m_tracer(nullptr)
+        {}
+
+        void wake()
+        {
+            int woken = m_futex.wake(m_fanout);
+            if (m_trace)
+                m_trace(m_tracer, m_record, woken);
+            m_pending.store(false, std::memory_order_release);
+        }
+
+        void wait_until_done() const
+        {
+            // The waking thread may have been preempted between releasing the mutex and the syscall.
+            for (uint32_t spins = 0; m_pending.load(std::memory_order_acquire); ++spins)
+            {
+                if (spins < MaxSpins)
+                    _cpu_relax();
+                else
+                    std::this_thread::yield();
+            }
+        }
+
+        static constexpr uint32_t MaxSpins = 64;
+        _FutexWrapper& m_futex;
+        int m_fanout; // Number of parked threads woken, the rest is left to them by wake chaining.
+        std::atomic<bool> m_pending;
+        const void* m_record;
+        // Called with m_tracer, the record and the number of threads woken once the syscall returns.
+        void (*m_trace)(void* tracer, const void* record, int woken);
+        void* m_tracer;
+    };
+
+
+    inline void _AsyncWaiter::resume_all(_AsyncWaiter* waiters)
+    {
+        // A continuation which unlocks can activate further waiters. Those are handed to the outermost
+        // resume_all of the thread so that chains of continuations do not grow the stack.
+        thread_local _AsyncWaiter* tl_pending = nullptr;
+        thread_local bool tl_resuming = false;
+
+        // Futex wakes are issued right away, also by nested calls, as their records can not be recycled
+        // before.
+        for (auto link = &waiters; *link;)
+        {
+            auto waiter = *link;
+            if (waiter->m_resume)
+            {
+                link = &waiter->m_next;
+                continue;
+            }
+            *link = waiter->m_next;
+            static_cast<_FutexWake*>(waiter)->wake();
+        }
+
+        if (not waiters)
+            return;
+
+        if (tl_resuming)
+        {
+            auto last = waiters;
+            while (last->m_next)
+                last = last->m_next;
+            last->m_next = tl_pending;
+            tl_pending = waiters;
+            return;
+        }
 
+        tl_resuming = true;
+        while (waiters)
+        {
+            auto next = waiters->m_next;
+            waiters->m_resume(waiters);
+            waiters = next;
+            if (not waiters)
+                std::swap(waiters, tl_pending);
+        }
+        tl_resuming = false;
+    }
+
+
+    struct _LockRecordBase
+    {
+        // Shared by the lock records of every key width.
         enum RecordType
         {
             None = 0,
@@ -371,41 +1228,134 @@ namespace bloomfilter_lock
             Exclusive = 3
         };
 
+        enum MergeResult
+        {
+            Merged = 0,
+            // The bits conflict but the kept keys of both sides do not, so the request was merged on the keys.
+            MergedOnExactKeys = 1,
+            // The record is a global write or has been closed by the request limit.
+            RejectedExclusive = 2,
+            // The request writes and the record is a global read.
+            RejectedReadOnly = 3,
+            // The request has more writes than a record accepts.
+            RejectedWriteLimit = 4,
+            // The request intention conflicts with the record intention on bits the kept keys could not check.
+            RejectedConflict = 5,
+            // The bits conflict and so do the kept keys of both sides, a true conflict.
+            RejectedKeyConflict = 6
+        };
+
+        static constexpr bool merged(MergeResult result) {return result <= MergedOnExactKeys;}
+    };
+
+
+    template <size_t Slots>
+    class _LockRecord: public _LockRecordBase
+    {
+    /* LockRecord:
+     * The main structure used to track the series of resources to be locked in a locking batch via a BloomFilterLock
+     */
+    public:
+        typedef BasicKey<Slots> KeyType;
+        typedef BasicLockIntention<Slots> IntentionType;
+
         _LockRecord() :
             m_num_waiting(0),
             m_num_locking(0),
             m_active(false),
+            m_num_requests(0),
             m_record_type(None),
-            m_num_requests(0)
+            m_wake(m_futex, this),
+            m_async_waiters(nullptr),
+            m_activation_time(0),
+            m_retired(false),
+            m_absorbed(nullptr),
+            m_in_arena(false),
+            m_priority(0),
+            m_bypassed(0),
+            m_barrier(false),
+            m_next(nullptr),
+            m_bit_counts()
+        {
+        }
+
+        // The record is closed to further requests once more than max_requests have been merged into it.
+        // Requests with more than max_writes writes are only accepted by an empty record. exact_keys is
+        // passed on to BasicLockIntention::merge.
+        MergeResult merge_lock_request(const IntentionType& l, size_t max_requests, size_t max_writes,
+                                       size_t exact_keys);
+
+        // Returns true if the request l can run concurrently with the requests in this record. Unlike
+        // merge_lock_request this ignores the limits on the number of requests merged into a record.
+        bool compatible_with(const IntentionType& l) const
+        {
+            switch (record_type())
+            {
+                case None:
+                    return true;
+                case ReadOnly:
+                    return l.m_min_writes == 0;
+                case Exclusive:
+                    // A global write request never has merged requests.
+                    return m_num_requests && m_lock_intention.compatible(l);
+                default:
+                    return m_lock_intention.compatible(l);
+            }
+        }
+
+        // Returns true if the requests in this record can run concurrently with the requests in r. Records
+        // which are not keyed only run together if neither writes.
+        bool compatible_with(const _LockRecord* r) const
         {
+            if (record_type() == None || r->record_type() == None)
+                return true;
+            if (not _keyed() || not r->_keyed())
+                return not writes() && not r->writes();
+            return m_lock_intention.compatible(r->m_lock_intention);
         }
 
-        bool merge_lock_request(const LockIntention& l);
+        // Returns true if a request in this record writes, which excludes global reads.
+        bool writes() const
+        {
+            switch (record_type())
+            {
+                case None:
+                case ReadOnly:
+                    return false;
+                case Exclusive:
+                    return not m_num_requests || m_lock_intention.m_min_writes;
+                default:
+                    return m_lock_intention.m_min_writes;
+            }
+        }
 
         bool global_write_request()
         {
             // This is always called under the mutex in BloomFilterLock
             // Don't need to hold m_lock when updating.
-            if (m_record_type == None)
+            if (record_type() == None)
             {
-                m_record_type = RecordType::Exclusive;
+                set_record_type(RecordType::Exclusive);
                 return true;
             }
 
             return false;
         }
 
-        bool merge_read_lock_request(Key key);
-        bool merge_write_lock_request(Key key);
+        MergeResult merge_read_lock_request(KeyType key, size_t max_requests, size_t max_writes, size_t exact_keys);
+        MergeResult merge_write_lock_request(KeyType key, size_t max_requests, size_t max_writes, size_t exact_keys);
+        template <typename MergeKey>
+        MergeResult _merge_key_request(KeyType key, size_t num_writes, size_t max_requests, size_t max_writes,
+                                       MergeKey merge_key);
         
         bool global_read_request()
         {
-            if (m_record_type == None)
+            if (record_type() == None)
             {
-                m_record_type = ReadOnly;
+                set_record_type(ReadOnly);
                 return true;
             }
-            else if (m_record_type == ReadOnly)
+            else if (record_type() == ReadOnly)
             {
                 return true;
             }
@@ -419,44 +1369,97 @@ namespace bloomfilter_lock
             // is queued back into the resource pool under the mutex in
             // BloomFilterLock and then allocated and re-used under the same
             // mutex and this is sufficient to establish happens-before
+            // A parked waiter can see the activation before the FUTEX_WAKE.
+            m_wake.wait_until_done();
             m_num_waiting = 0;
             m_num_locking = 0;
             m_active = false;
-            m_record_type = None;           
+            set_record_type(None);
             m_num_requests = 0;
+            _reset_counts();
             m_lock_intention.clear();
+            m_async_waiters = nullptr;
+            m_retired = false;
+            m_absorbed = nullptr;
+            m_priority = 0;
+            m_bypassed = 0;
+            m_barrier = false;
             m_futex.reset();
         }
 
         RecordType record_type() const
         {
-            return  m_record_type;
+            // Written under the mutex in BloomFilterLock. Reads outside of it are only used as a hint.
+            return m_record_type.load(std::memory_order_relaxed);
         }
 
-        void activate()
+        // Returns true if a request with the given number of writes can not be merged into this record.
+        bool closed_to(size_t num_writes) const
+        {
+            auto type = record_type();
+            return type == Exclusive || (type == ReadOnly && num_writes);
+        }
+
+        // Returns the asynchronous waiters of the record, which now hold the lock. The caller resumes
+        // them once it has released the mutex in BloomFilterLock.
+        // The FUTEX_WAKE for parked waiters is returned as well, as m_wake, waking up to fanout of them.
+        _AsyncWaiter* activate(int fanout = INT_MAX)
         {      
             // Holding this lock while signalling the futex establishes
             // happens-before on the state change m_futex = 0 -> 1 for the
             // receiver of the futex signal.
             std::unique_lock<_SpinLock> guard(m_lock);            
+            _AsyncWaiter* waiters = nullptr;
             if (!m_active)
             {
                 m_active = true;                
-                m_futex.signal();
+                std::swap(waiters, m_async_waiters);
+                for (auto w = waiters; w; w = w->m_next)
+                {
+                    ++m_num_locking;
+                    --m_num_waiting;
+                }
+                if (m_futex.set_signalled())
+                {
+                    m_wake.m_fanout = fanout;
+                    m_wake.m_pending.store(true, std::memory_order_relaxed);
+                    m_wake.m_next = waiters;
+                    waiters = &m_wake;
+                }
+            }
+            return waiters;
+        }
+
+        // Replaces the futex wait of a latched request. Returns false if the record is already active, in
+        // which case the caller holds the lock and waiter will not be resumed.
+        bool add_async_waiter(_AsyncWaiter* waiter)
+        {
+            std::unique_lock<_SpinLock> guard(m_lock);
+            if (m_active)
+            {
+                ++m_num_locking;
+                --m_num_waiting;
+                return false;
             }
+            waiter->m_next = m_async_waiters;
+            m_async_waiters = waiter;
+            return true;
         }
 
-        void _wait_impl()
+        template <typename WaitPolicy>
+        bool _wait_impl(WaitPolicy& wait_policy)
         {                                        
             std::unique_lock<_SpinLock> guard(m_lock);
+            bool parked = false;
             if (!m_active)
             {
                 guard.unlock();
-                m_futex.wait();
+                parked = wait_policy.wait(m_futex);
                 guard.lock();
             }
             ++m_num_locking;
             --m_num_waiting;
+            return parked;
         }
                 
         void _latch()
@@ -464,9 +1467,64 @@ namespace bloomfilter_lock
            ++m_num_waiting;
         }
                 
-        void wait()
+        // Returns true if the caller had to park on the record futex.
+        template <typename WaitPolicy>
+        bool wait(WaitPolicy& wait_policy)
         {             
-            _wait_impl();
+            return _wait_impl(wait_policy);
+        }
+
+        // Returns false if the deadline passed first, the caller then still counts as waiting and must
+        // call withdraw.
+        template <typename WaitPolicy>
+        bool wait_until(WaitPolicy& wait_policy, std::chrono::steady_clock::time_point deadline)
+        {
+            std::unique_lock<_SpinLock> guard(m_lock);
+            if (!m_active)
+            {
+                guard.unlock();
+                if (not wait_policy.wait_until(m_futex, deadline))
+                    return false;
+                guard.lock();
+            }
+            ++m_num_locking;
+            --m_num_waiting;
+            return true;
+        }
+
+        // Called under the mutex in BloomFilterLock by a waiter whose deadline passed. Returns true if the
+        // record was activated in the meantime, in which case the caller holds the lock after all.
+        bool withdraw()
+        {
+            std::unique_lock<_SpinLock> guard(m_lock);
+            --m_num_waiting;
+            if (m_active)
+            {
+                ++m_num_locking;
+                return true;
+            }
+            return false;
+        }
+
+        // Raises the priority of the record to that of a request merged into it, see PriorityLanes.
+        void raise_priority(uint8_t priority)
+        {
+            m_priority = std::max(m_priority, priority);
+        }
+
+        // Returns true from the activation of the record until it is cleared.
+        bool activated()
+        {
+            std::unique_lock<_SpinLock> guard(m_lock);
+            return m_active;
+        }
+
+        // Returns true if every request merged into this record has withdrawn. Only meaningful under the
+        // mutex in BloomFilterLock for a record which is not yet active.
+        bool abandoned()
+        {
+            std::unique_lock<_SpinLock> guard(m_lock);
+            return m_num_waiting == 0 && m_num_locking == 0;
         }
         
         bool release()
@@ -477,6 +1535,7 @@ namespace bloomfilter_lock
                 std::unique_lock<_SpinLock> guard(m_lock);
                 num_locking = --m_num_locking;
                 num_waiting = m_num_waiting;
+                m_retired = (num_locking == 0 && num_waiting == 0);
             }
             bool return_value = (num_locking == 0 && num_waiting == 0);           
             
@@ -485,43 +1544,475 @@ namespace bloomfilter_lock
             return return_value;
         }
 
-        void close()
+        // Adds a request to this active record, merge merges it and returns true on success. Returns false
+        // without calling merge once the last holder has released the record. The caller then waits on the
+        // record as if latched, which returns at once.
+        template <typename Merge>
+        bool join(Merge merge)
         {
             std::unique_lock<_SpinLock> guard(m_lock);
-            if (m_active)
-            {
-                std::cerr << "close called while lock record is active" << std::endl;                
-            }
+            if (m_retired || not merge())
+                return false;
+            ++m_num_waiting;
+            return true;
         }
 
-    private:
-        size_t m_num_waiting;
-        std::size_t m_num_locking;
-        bool  m_active;
-        
-        size_t m_num_requests;
-        RecordType m_record_type;
-        LockIntention m_lock_intention;
-
-        _FutexWrapper m_futex;
-        _SpinLock m_lock;
-    };
-
-    
-    template <typename T>
-    class _TLResourceTracker
-    {
-        // Keeps track of BloomFilterLocks owned by the current thread. This is to prevent recursive locks. This is
-        // not allowed.
-    public:
-        _TLResourceTracker():
-            m_count(0),
-            m_locks(16)
-        {}
-    
-        void track(BloomFilterLock<T>* lock)
+        /* downgrade and upgrade change the request of a holder of this active record in place. They are
+         * called under the mutex in BloomFilterLock, which keeps joins out. held is the request of the
+         * caller, see _HeldIntention, and global is set for a global write. If the keys of held and
+         * reads_only are known, downgrade gives back the writes and the dropped reads of held through the
+         * counts like release_part, which also works for a record shared with other holders. reads_only
+         * must keep a subset of the keys of held. Otherwise only the intention of a sole holder is replaced.
+         * Returns false if the request was left as it is. upgrade falls back to the kept keys if there is
+         * more than one holder.
+         */
+        bool downgrade(const IntentionType& held, bool global, const IntentionType& reads_only)
         {
-            for (auto n = 0; n < m_count; ++n)
+            std::unique_lock<_SpinLock> guard(m_lock);
+            bool sole = m_num_locking == 1 && not m_num_waiting;
+            switch (record_type())
+            {
+                case None:
+                    return false;
+                case ReadOnly:
+                    // Nothing is counted, the reads are held until the record drains.
+                    return not global && held._contains(reads_only);
+                case Exclusive:
+                    if (not m_num_requests)
+                    {
+                        // A global write becomes an ordinary request.
+                        if (not global || not sole)
+                            return false;
+                        set_record_type(ReadWrite);
+                        m_num_requests = 1;
+                        _reset_counts();
+                        m_lock_intention = reads_only;
+                        _count(reads_only);
+                        return true;
+                    }
+                    // fall through
+                default:
+                    break;
+            }
+
+            if (global)
+                return false;
+            if (held.m_num_exact_keys != IntentionType::exact_keys_unknown &&
+                reads_only.m_num_exact_keys != IntentionType::exact_keys_unknown)
+            {
+                // left ends up with the dropped keys of held, bit k of kept_writes is set if key k of
+                // reads_only was written by held.
+                IntentionType left(held);
+                uint8_t kept_writes = 0;
+                for(size_t k = 0; k < reads_only.m_num_exact_keys; ++k)
+                {
+                    KeyType key(reads_only.m_exact_keys[k]);
+                    if (left._remove_exact_key(key, false))
+                        continue;
+                    if (not left._remove_exact_key(key, true))
+                        return false;
+                    kept_writes |= uint8_t(1) << k;
+                }
+
+                for(size_t k = 0; k < left.m_num_exact_keys; ++k)
+                {
+                    KeyType key(left.m_exact_keys[k]);
+                    bool write = (left.m_exact_writes >> k) & 1;
+                    _uncount_key(key, write);
+                    m_lock_intention._remove_exact_key(key, write);
+                }
+                for(size_t k = 0; k < reads_only.m_num_exact_keys; ++k)
+                {
+                    if (not ((kept_writes >> k) & 1))
+                        continue;
+                    KeyType key(reads_only.m_exact_keys[k]);
+                    _uncount_key(key, true, false);
+                    if (m_lock_intention._remove_exact_key(key, true))
+                        m_lock_intention._add_exact_key(key, false, IntentionType::max_exact_keys);
+                }
+                _keep_min_counts();
+                return true;
+            }
+
+            if (not sole || not held._contains(reads_only))
+                return false;
+            _reset_counts();
+            m_lock_intention = reads_only;
+            _count(reads_only);
+            return true;
+        }
+
+        // held is the request of the caller, see _HeldIntention.
+        bool upgrade(KeyType key, const IntentionType& held)
+        {
+            std::unique_lock<_SpinLock> guard(m_lock);
+            switch (record_type())
+            {
+                case None:
+                case ReadOnly:
+                    return false;
+                case Exclusive:
+                    if (not m_num_requests)
+                        return true;
+                    // fall through
+                default:
+                {
+                    // The bits of a read the caller holds are already counted.
+                    bool reads = held._keeps_key(key, false);
+                    if (not m_lock_intention._upgrade_exact_key(key, reads))
+                    {
+                        if (m_num_locking != 1 || m_num_waiting)
+                            return false;
+                        if (not reads || not m_lock_intention._flip_exact_key(key))
+                            m_lock_intention.add_write_key(key);
+                    }
+                    _count_key(key, true, not reads);
+                    return true;
+                }
+            }
+        }
+
+        /* Gives back part of the footprint of a holder of this active record, called under the mutex in
+         * BloomFilterLock. part must be kept by the request of the holder, see BasicLockIntention and
+         * _HeldIntention, so that its keys are counted. The minimum read and write counts only drop for
+         * keys whose bits were not pinned and stay at least 1 while bits are left, which keeps merge and
+         * compatible from treating the record as empty. Returns true if bits of the record intention were
+         * cleared.
+         */
+        bool release_part(const IntentionType& part)
+        {
+            // Requests merged into a ReadOnly record are not counted, they hold it until the end.
+            if (not m_lock_intention.m_min_reads)
+                return false;
+
+            bool cleared = false;
+            for(size_t k = 0; k < part.m_num_exact_keys; ++k)
+            {
+                KeyType key(part.m_exact_keys[k]);
+                bool write = (part.m_exact_writes >> k) & 1;
+                cleared |= _uncount_key(key, write);
+                m_lock_intention._remove_exact_key(key, write);
+            }
+            _keep_min_counts();
+            return cleared;
+        }
+
+        /* Merges the queued record r into this active record, which takes over the requests waiting on r
+         * as holders. They release this record, r must be activated and is cleared along with this record.
+         * Called under the mutex in BloomFilterLock, which also guards the queue r was taken from.
+         */
+        bool absorb(_LockRecord* r, size_t exact_keys)
+        {
+            if (not _keyed() || not r->_keyed())
+                return false;
+
+            std::unique_lock<_SpinLock> guard(m_lock);
+            std::unique_lock<_SpinLock> record_guard(r->m_lock);
+            if (m_retired || not r->m_num_waiting || not m_lock_intention.merge(r->m_lock_intention, exact_keys))
+                return false;
+
+            for(size_t i = 0; i < 2 * Slots; ++i)
+            {
+                for (auto bits = _bits(r->m_lock_intention, i); bits; bits &= bits - 1)
+                {
+                    auto bit = __builtin_ctzll(bits);
+                    m_bit_counts[i][bit] = uint8_t(std::min<unsigned>(unsigned(m_bit_counts[i][bit]) +
+                                                                      r->m_bit_counts[i][bit], pinned));
+                }
+            }
+            m_num_requests += r->m_num_requests;
+            m_num_locking += r->m_num_waiting;
+            r->m_absorbed = m_absorbed;
+            m_absorbed = r;
+            return true;
+        }
+
+        void close()
+        {
+            std::unique_lock<_SpinLock> guard(m_lock);
+            if (m_active)
+            {
+                std::cerr << "close called while lock record is active" << std::endl;                
+            }
+        }
+
+    private:
+        template <typename Record>
+        friend class _LockQueue;
+        template <typename InternalLockType, typename WaitPolicy, typename MergePolicy, typename Instrumentation,
+                  size_t KeySlots, typename Tracking>
+        friend class BloomFilterLock;
+
+        void set_record_type(RecordType type)
+        {
+            m_record_type.store(type, std::memory_order_relaxed);
+        }
+
+        // Returns true if the record holds keyed requests, whose bits are counted.
+        bool _keyed() const
+        {
+            auto type = record_type();
+            return type == ReadWrite || (type == Exclusive && m_num_requests);
+        }
+
+        /* m_bit_counts is a counting filter over the bits of m_lock_intention, read bits of slot i at
+         * index i and write bits at Slots + i as in BasicLockIntention. Each counter is the number of merged
+         * keys which set the bit. Requests merged without their keys saturate the counters of their bits at
+         * pinned, which stay set until the record is cleared.
+         */
+        static constexpr uint8_t pinned = 0xFF;
+
+        static uint64_t& _bits(IntentionType& l, size_t i)
+        {
+            return i < Slots ? l.m_read_indicators[i] : l.m_write_indicators[i - Slots];
+        }
+
+        static uint64_t _bits(const IntentionType& l, size_t i)
+        {
+            return i < Slots ? l.m_read_indicators[i] : l.m_write_indicators[i - Slots];
+        }
+
+        void _count_bit(size_t i, size_t bit)
+        {
+            if (m_bit_counts[i][bit] != pinned)
+                ++m_bit_counts[i][bit];
+        }
+
+        // Returns true if the bit was cleared from the intention.
+        bool _uncount_bit(size_t i, size_t bit)
+        {
+            auto& count = m_bit_counts[i][bit];
+            if (count == pinned)
+                return false;
+            // Giving back a key which is not held.
+            if (not count)
+                std::terminate();
+            if (--count)
+                return false;
+            _bits(m_lock_intention, i) &= ~(uint64_t(1) << bit);
+            return true;
+        }
+
+        // count_reads is cleared to only count the write bits of a key whose read is counted already.
+        void _count_key(KeyType key, bool write, bool count_reads = true)
+        {
+            if (key.m_value == 0)
+                return;
+            // Prefix keys are not kept by intentions either, they can only be given back with the record.
+            bool pin = key.m_value & typename KeyType::value_type(0x8080808080808080ull);
+            for(size_t i = 0; i < Slots; ++i)
+            {
+                for (size_t j = count_reads ? i : Slots + i; j < (write ? 2 * Slots : Slots); j += Slots)
+                {
+                    if (pin)
+                        m_bit_counts[j][key._byte(i) & 0x3F] = pinned;
+                    else
+                        _count_bit(j, key._byte(i) & 0x3F);
+                }
+            }
+        }
+
+        /* Gives back the bits of key counted by _count_key, reads is cleared to only give back its write bits.
+         * The minimum counts of the intention only drop if the bits of key were counted, not pinned. Returns
+         * true if bits were cleared from the intention.
+         */
+        bool _uncount_key(KeyType key, bool write, bool reads = true)
+        {
+            bool cleared = false, counted_read = reads, counted_write = write;
+            for(size_t i = 0; i < Slots; ++i)
+            {
+                for (size_t j = reads ? i : Slots + i; j < (write ? 2 * Slots : Slots); j += Slots)
+                {
+                    (j < Slots ? counted_read : counted_write) &= m_bit_counts[j][key._byte(i) & 0x3F] != pinned;
+                    cleared |= _uncount_bit(j, key._byte(i) & 0x3F);
+                }
+            }
+            if (counted_read && m_lock_intention.m_min_reads)
+                --m_lock_intention.m_min_reads;
+            if (counted_write && m_lock_intention.m_min_writes)
+                --m_lock_intention.m_min_writes;
+            return cleared;
+        }
+
+        // Keeps the minimum counts at 1 while bits are left, an intention with both at 0 is empty to merge
+        // and compatible.
+        void _keep_min_counts()
+        {
+            bool reads_left = false, writes_left = false;
+            for(size_t i = 0; i < Slots; ++i)
+            {
+                reads_left |= m_lock_intention.m_read_indicators[i] != 0;
+                writes_left |= m_lock_intention.m_write_indicators[i] != 0;
+            }
+            if (reads_left && not m_lock_intention.m_min_reads)
+                m_lock_intention.m_min_reads = 1;
+            if (writes_left && not m_lock_intention.m_min_writes)
+                m_lock_intention.m_min_writes = 1;
+        }
+
+        void _count(const IntentionType& l)
+        {
+            if (l.m_num_exact_keys != IntentionType::exact_keys_unknown)
+            {
+                for(size_t k = 0; k < l.m_num_exact_keys; ++k)
+                    _count_key(KeyType(l.m_exact_keys[k]), (l.m_exact_writes >> k) & 1);
+                return;
+            }
+
+            for(size_t i = 0; i < 2 * Slots; ++i)
+            {
+                for (auto bits = _bits(l, i); bits; bits &= bits - 1)
+                    m_bit_counts[i][__builtin_ctzll(bits)] = pinned;
+            }
+        }
+
+        void _reset_counts()
+        {
+            // Only the counters of bits set in the intention can be non zero.
+            for(size_t i = 0; i < 2 * Slots; ++i)
+            {
+                for (auto bits = _bits(m_lock_intention, i); bits; bits &= bits - 1)
+                    m_bit_counts[i][__builtin_ctzll(bits)] = 0;
+            }
+        }
+
+        size_t m_num_waiting;
+        std::size_t m_num_locking;
+        bool  m_active;
+        
+        size_t m_num_requests;
+        std::atomic<RecordType> m_record_type;
+        IntentionType m_lock_intention;
+
+        _FutexWrapper m_futex;
+        _FutexWake m_wake;
+        _SpinLock m_lock;
+        _AsyncWaiter* m_async_waiters; // Guarded by m_lock.
+        uint64_t m_activation_time; // Set on activation by instrumented BloomFilterLocks.
+        bool m_retired; // Set under m_lock by the release of the last holder.
+
+        // Records absorbed into this active record, linked through their m_absorbed.
+        _LockRecord* m_absorbed;
+        bool m_in_arena; // Set for the records of the arena of a BloomFilterLock, kept by clear().
+
+        // Scheduling state, guarded by the mutex in BloomFilterLock once the record is queued.
+        uint8_t m_priority; // Highest priority class of the requests merged into the record.
+        uint32_t m_bypassed; // Times a record queued behind this one was activated first.
+        bool m_barrier; // Records queued behind this one may not be activated before it.
+
+        // Intrusive link to the next record in the lock queue.
+        std::atomic<_LockRecord*> m_next;
+        uint8_t m_bit_counts[2 * Slots][64]; // Guarded by the mutex in BloomFilterLock.
+    };
+
+
+    template <typename Record>
+    class _LockQueue
+    {
+    /* _LockQueue:
+     * Intrusive multi producer, single consumer queue of _LockRecords linked through _LockRecord::m_next.
+     * push is lock free and may be called from any thread. front, next, back and pop form the single
+     * consumer side and must only be called under the mutex in BloomFilterLock. The queue is never empty:
+     * its front is always the record new requests are merged into. Pushing never allocates.
+     */
+    public:
+        explicit _LockQueue(Record* front):
+            m_head(front),
+            m_tail(front)
+        {
+        }
+
+        void push(Record* r)
+        {
+            r->m_next.store(nullptr, std::memory_order_relaxed);
+            // seq_cst so a producer checking for an active record after pushing can not miss a
+            // concurrent unlock which checks the queue after clearing the active record.
+            auto prev = m_tail.exchange(r, std::memory_order_seq_cst);
+            prev->m_next.store(r, std::memory_order_release);
+        }
+
+        Record* front() const
+        {
+            // May be read outside the mutex in BloomFilterLock as a hint.
+            return m_head.load(std::memory_order_acquire);
+        }
+
+        Record* back() const
+        {
+            return m_tail.load(std::memory_order_seq_cst);
+        }
+
+        // Returns the record behind r or nullptr if r is at the back of the queue. Waits for a
+        // push which has already claimed the back of the queue to link its record.
+        Record* next(Record* r) const
+        {
+            auto n = r->m_next.load(std::memory_order_acquire);
+            if (n || back() == r)
+                return n;
+
+            while (not (n = r->m_next.load(std::memory_order_acquire)))
+                _cpu_relax();
+            return n;
+        }
+
+        // Removes the front record. spare replaces it if it is the only record in the queue, spare may
+        // only be nullptr if the front is known to have a successor. Returns false if spare was not needed.
+        bool pop(Record* spare)
+        {
+            auto head = front();
+            auto n = next(head);
+            bool spare_used = false;
+            if (not n && spare)
+            {
+                auto expected = head;
+                spare->m_next.store(nullptr, std::memory_order_relaxed);
+                if (m_tail.compare_exchange_strong(expected, spare, std::memory_order_seq_cst))
+                {
+                    head->m_next.store(spare, std::memory_order_release);
+                    spare_used = true;
+                }
+                n = next(head);
+            }
+            m_head.store(n, std::memory_order_release);
+            return spare_used;
+        }
+
+        // Unlinks r, which is queued right behind prev. Consumer side like pop.
+        void remove(Record* prev, Record* r)
+        {
+            auto n = r->m_next.load(std::memory_order_acquire);
+            if (not n)
+            {
+                // r is the back unless a push has already claimed it, which then links behind r.
+                prev->m_next.store(nullptr, std::memory_order_relaxed);
+                auto expected = r;
+                if (m_tail.compare_exchange_strong(expected, prev, std::memory_order_seq_cst))
+                    return;
+                n = next(r);
+            }
+            prev->m_next.store(n, std::memory_order_release);
+        }
+
+    private:
+        alignas(_cache_line_size) std::atomic<Record*> m_head;
+        alignas(_cache_line_size) std::atomic<Record*> m_tail;
+    };
+
+    
+    template <typename LockType>
+    class _TLResourceTracker
+    {
+        // Keeps track of BloomFilterLocks owned by the current thread. This is to prevent recursive locks. This is
+        // not allowed.
+    public:
+        _TLResourceTracker():
+            m_locks(16),
+            m_count(0)
+        {}
+    
+        void track(LockType* lock)
+        {
+            for (size_t n = 0; n < m_count; ++n)
             {
                 if (m_locks[n] == lock)
                     std::terminate();
@@ -539,17 +2030,26 @@ namespace bloomfilter_lock
         }
         
         
-        void untrack(BloomFilterLock<T> * lock)
+        bool tracked(const LockType* lock) const
+        {
+            for (size_t n = 0; n < m_count; ++n)
+            {
+                if (m_locks[n] == lock)
+                    return true;
+            }
+            return false;
+        }
+
+
+        void untrack(LockType* lock)
         {
-            for (auto n = 0; n < m_count; ++n)
+            for (size_t n = 0; n < m_count; ++n)
             {
                 if (m_locks[n] == lock)
                 {
-                    m_locks[n] = nullptr;
-                    if (m_count > 1)
-                    {
-                        m_locks[n] = m_locks[n-1];
-                    }
+                    // Move the last tracked lock into the freed slot to keep the tracked locks contiguous.
+                    m_locks[n] = m_locks[m_count - 1];
+                    m_locks[m_count - 1] = nullptr;
                     --m_count;
                     return;
                 }
@@ -559,82 +2059,1758 @@ namespace bloomfilter_lock
         
     private:
         // Vector of resource locks owned by this thread
-        std::vector<BloomFilterLock<T>*> m_locks;
+        std::vector<LockType*> m_locks;
         size_t m_count; // count of resource locks currently owned. The capacity of m_locks could be greater.
     };
 
-    
-    template <typename InternalLockType=std::mutex>        
-    class BloomFilterLock
+
+    template <size_t Slots>
+    struct _HeldIntention
+    {
+        // A request held through a lock record, which try_upgrade, downgrade and the partial releases check
+        // the caller against. m_record is the record the request waited on, the active record or one absorbed
+        // into it. Global writes are kept without an intention.
+        const void* m_lock;
+        _LockRecord<Slots>* m_record;
+        bool m_global_write;
+        BasicLockIntention<Slots> m_intention;
+    };
+
+
+    /* Tracking policies of BloomFilterLock. A thread may not make a request on a BloomFilterLock through
+     * which it already holds resources, track is called on every synchronous request and untrack on its
+     * release. Both call std::terminate on misuse. hold keeps the request the thread holds through a lock
+     * record, see _HeldIntention, held looks it up and release drops it on unlock. Fast path holders, biased
+     * reads and asynchronous or batch requests are not kept.
+     */
+    class ScanTracking
     {
+    /* ScanTracking
+     * Default tracking policy. Keeps the locks held by the thread in one thread local list, which every
+     * call scans. Cheap for threads which hold a few locks at a time.
+     */
     public:
-        
-        BloomFilterLock();
-        BloomFilterLock(const BloomFilterLock& rhs) = delete;
-        BloomFilterLock& operator = (const BloomFilterLock& rhs) = delete;
-        ~BloomFilterLock();
-        void global_read_lock();
-        void global_write_lock();
-        
-        template <typename T>
-        void multilock(const T& reads, const T& writes);
-        void multilock(const LockIntention& l);
-        void read_lock(Key readKey);
-        void write_lock(Key writeKey);
-        void unlock();
+        void track(const void* lock) {tl_held_locks().track(lock);}
+        void untrack(const void* lock) {tl_held_locks().untrack(lock);}
 
-    private:
+        template <size_t Slots>
+        void hold(const _HeldIntention<Slots>& request) {tl_held_requests<Slots>().push_back(request);}
 
-        _LockRecord *allocate_lock_record();
-        inline void wait_at_queue_front(std::unique_lock<InternalLockType>& guard)
+        template <size_t Slots>
+        _HeldIntention<Slots>* held(const void* lock)
         {
-            _LockRecord * r = m_lock_queue.front();
-            r->_latch();            
-                        
-            if (!m_active_lock_record)
+            for (auto& request: tl_held_requests<Slots>())
             {
-                m_active_lock_record = r;                
-                m_lock_queue.pop();
-                r->activate();
-                // The queue framework requires there to be a record in the queue at all times.
-                if (m_lock_queue.empty())
-                    m_lock_queue.push(allocate_lock_record());
+                if (request.m_lock == lock)
+                    return &request;
             }
+            return nullptr;
+        }
 
-            guard.unlock();
-            r->wait();            
+        template <size_t Slots>
+        void release(const void* lock)
+        {
+            auto& requests = tl_held_requests<Slots>();
+            for (auto& request: requests)
+            {
+                if (request.m_lock == lock)
+                {
+                    request = requests.back();
+                    requests.pop_back();
+                    return;
+                }
+            }
         }
 
-        inline void wait_at_queue_back(std::unique_lock<InternalLockType>& guard, _LockRecord * new_record)
+    private:
+        static _TLResourceTracker<const void>& tl_held_locks()
         {
-            new_record->_latch();
-            m_lock_queue.push(new_record);
-            guard.unlock();
-            new_record->wait();
-            
+            static thread_local _TLResourceTracker<const void> held_locks;
+            return held_locks;
         }
-        
-        inline void wait_at_queue_back(std::unique_lock<InternalLockType>& guard)
+
+        template <size_t Slots>
+        static std::vector<_HeldIntention<Slots>>& tl_held_requests()
         {
-            auto queue_back = m_lock_queue.back();
-            queue_back->_latch();
-            guard.unlock();
-            queue_back->wait();
-            
+            static thread_local std::vector<_HeldIntention<Slots>> held_requests;
+            return held_requests;
         }
+    };
 
-        /* Track the set of resource locks held by each thread.  This is here to prevent an attempt to make a lock
-         * request on a BloomFilterLock through which some resources are already locked.  That pattern is not permissible
-         * via the resource_lock scheme.  An exception results if that occurs.  Consider a set of item Keys
-         * which can all be locked collectively via their controlling Key instead in that case.
-         */
-        static thread_local _TLResourceTracker<InternalLockType> tl_existing_locks;
 
-        _LockRecord* m_active_lock_record;
-        std::vector<_LockRecord*> m_record_pool;
-        std::queue<_LockRecord*> m_lock_queue;
-        InternalLockType m_mutex; // For locking recordPool and internal structures.
-        bool m_closing; // Set to true during the destructor sequence.        
+    class IndexedTracking
+    {
+    /* IndexedTracking
+     * Gives every lock an index for its lifetime, under which each thread keeps a held flag in a thread
+     * local table, so tracking is O(1) however many locks a thread holds. Indexes of destroyed locks are
+     * reused and the table of a thread grows to the highest index it has locked.
+     */
+    public:
+        IndexedTracking():
+            m_index(allocate_index())
+        {
+        }
+
+        IndexedTracking(const IndexedTracking&) = delete;
+        IndexedTracking& operator = (const IndexedTracking&) = delete;
+
+        ~IndexedTracking()
+        {
+            std::unique_lock<std::mutex> guard(index_mutex());
+            free_indexes().push_back(m_index);
+        }
+
+        void track(const void*)
+        {
+            auto& held = tl_held();
+            if (m_index >= held.size())
+                held.resize(m_index + 1);
+            if (held[m_index])
+                std::terminate();
+            held[m_index] = 1;
+        }
+
+        void untrack(const void*)
+        {
+            auto& held = tl_held();
+            if (m_index >= held.size() || not held[m_index])
+                std::terminate();
+            held[m_index] = 0;
+        }
+
+        // The held requests of a thread are kept under the index of their lock as well.
+        template <size_t Slots>
+        void hold(const _HeldIntention<Slots>& request)
+        {
+            auto& requests = tl_held_requests<Slots>();
+            if (m_index >= requests.size())
+                requests.resize(m_index + 1);
+            requests[m_index] = request;
+        }
+
+        template <size_t Slots>
+        _HeldIntention<Slots>* held(const void*)
+        {
+            auto& requests = tl_held_requests<Slots>();
+            return m_index < requests.size() && requests[m_index].m_lock ? &requests[m_index] : nullptr;
+        }
+
+        template <size_t Slots>
+        void release(const void*)
+        {
+            auto& requests = tl_held_requests<Slots>();
+            if (m_index < requests.size())
+                requests[m_index].m_lock = nullptr;
+        }
+
+    private:
+        static size_t allocate_index()
+        {
+            static size_t next_index = 0;
+            std::unique_lock<std::mutex> guard(index_mutex());
+            if (free_indexes().empty())
+                return next_index++;
+            auto index = free_indexes().back();
+            free_indexes().pop_back();
+            return index;
+        }
+
+        static std::mutex& index_mutex()
+        {
+            static std::mutex mutex;
+            return mutex;
+        }
+
+        static std::vector<size_t>& free_indexes()
+        {
+            static std::vector<size_t> indexes;
+            return indexes;
+        }
+
+        static std::vector<uint8_t>& tl_held()
+        {
+            static thread_local std::vector<uint8_t> held;
+            return held;
+        }
+
+        template <size_t Slots>
+        static std::vector<_HeldIntention<Slots>>& tl_held_requests()
+        {
+            static thread_local std::vector<_HeldIntention<Slots>> held_requests;
+            return held_requests;
+        }
+
+        const size_t m_index;
+    };
+
+
+    /* Tracking policy for fully audited code, which leaves recursion unchecked. Requests may be released by
+     * another thread than the one which took them, so held requests are not kept either and partial
+     * releases, downgrade and try_upgrade return false.
+     */
+    struct NoTracking
+    {
+        void track(const void*) {}
+        void untrack(const void*) {}
+
+        template <size_t Slots>
+        void hold(const _HeldIntention<Slots>&) {}
+        template <size_t Slots>
+        _HeldIntention<Slots>* held(const void*) {return nullptr;}
+        template <size_t Slots>
+        void release(const void*) {}
+    };
+
+
+    struct _FastPath
+    {
+    /* _FastPath
+     * The packed state word of the uncontended fast path of a BloomFilterLock. While the lock queue is
+     * idle a request takes the lock with a single CAS on the word, which holds the number of fast path
+     * holders and a summary of their keys: the slot 0 bits of their reads and writes, folded into 24 bits
+     * each. Keys differing in slot 0 never conflict, so a request whose summary does not overlap the one
+     * of the holders can run alongside them. The summary only grows until the last holder releases.
+     * Activating a record closes the word and waits for the holders to drain, the last of them activates
+     * the queue. The word is opened again once the queue is idle.
+     */
+        static constexpr uint64_t SummaryMask = (uint64_t(1) << 24) - 1;
+        static constexpr int AccessShift = 24;
+        static constexpr int HolderShift = 48;
+        static constexpr uint64_t OneHolder = uint64_t(1) << HolderShift;
+        static constexpr uint64_t HolderMask = uint64_t(0x7FFF) << HolderShift;
+        static constexpr uint64_t Closed = uint64_t(1) << 63;
+        // The summary of a global request, which conflicts with every write, or every holder if it writes.
+        static constexpr uint64_t AllAccesses = SummaryMask << AccessShift;
+        static constexpr uint64_t AllWrites = SummaryMask;
+
+        // read_bits and write_bits are slot 0 indicators, read_bits include the writes.
+        static uint64_t summary(uint64_t read_bits, uint64_t write_bits)
+        {
+            return _fold(write_bits) | (_fold(read_bits) << AccessShift);
+        }
+
+        static bool try_acquire(std::atomic<uint64_t>& state, uint64_t summary)
+        {
+            uint64_t current = state.load(std::memory_order_relaxed);
+            while (not (current & Closed) && (current & HolderMask) != HolderMask && _compatible(current, summary))
+            {
+                if (state.compare_exchange_weak(current, (current | summary) + OneHolder, std::memory_order_acquire,
+                                                std::memory_order_relaxed))
+                    return true;
+            }
+            return false;
+        }
+
+        // Returns true if the caller was the last holder of a closed fast path and has to activate the queue.
+        static bool release(std::atomic<uint64_t>& state)
+        {
+            uint64_t current = state.load(std::memory_order_relaxed);
+            uint64_t next;
+            do
+            {
+                next = current - OneHolder;
+                if (not (next & HolderMask))
+                    next &= Closed;
+            } while (not state.compare_exchange_weak(current, next, std::memory_order_release, std::memory_order_relaxed));
+            return next == Closed;
+        }
+
+        // Returns true while fast path holders remain. No new holders are admitted once closed.
+        static bool close(std::atomic<uint64_t>& state)
+        {
+            uint64_t current = state.load(std::memory_order_acquire);
+            if (not (current & Closed))
+                current = state.fetch_or(Closed, std::memory_order_acq_rel);
+            return current & HolderMask;
+        }
+
+        static void open(std::atomic<uint64_t>& state)
+        {
+            state.fetch_and(~Closed, std::memory_order_relaxed);
+        }
+
+        static bool held(const std::atomic<uint64_t>& state)
+        {
+            return state.load(std::memory_order_relaxed) & HolderMask;
+        }
+
+        static uint64_t _fold(uint64_t bits)
+        {
+            return (bits | (bits >> 24) | (bits >> 48)) & SummaryMask;
+        }
+
+        static bool _compatible(uint64_t state, uint64_t summary)
+        {
+            uint64_t writes = summary & SummaryMask;
+            uint64_t accesses = (summary >> AccessShift) & SummaryMask;
+            return not (writes & (state >> AccessShift) & SummaryMask) && not (accesses & state & SummaryMask);
+        }
+    };
+
+    
+    /* Keyed lock requests as merged into the lock queue by BloomFilterLock.
+     * merge_into tries to add the request to a record, compatible_with checks whether the request could
+     * run alongside a record regardless of the record capacity. intention is the request as an intention
+     * and fast_summary its summary for the fast path, see _FastPath.
+     */
+    template <size_t Slots>
+    struct _IntentionRequest
+    {
+        const BasicLockIntention<Slots>& m_intention;
+        uint8_t m_priority = 0;
+
+        size_t num_writes() const {return m_intention.m_min_writes;}
+        template <typename Limits>
+        _LockRecordBase::MergeResult merge_into(_LockRecord<Slots>* r, const Limits& limits) const
+        {
+            return r->merge_lock_request(m_intention, limits.max_requests(), limits.max_writes(),
+                                         limits.exact_keys());
+        }
+        bool compatible_with(const _LockRecord<Slots>* r) const {return r->compatible_with(m_intention);}
+        const BasicLockIntention<Slots>& intention() const {return m_intention;}
+        uint64_t fast_summary() const
+        {
+            return _FastPath::summary(m_intention.m_read_indicators[0], m_intention.m_write_indicators[0]);
+        }
+    };
+
+
+    template <size_t Slots>
+    struct _ReadKeyRequest
+    {
+        BasicKey<Slots> m_key;
+        uint8_t m_priority = 0;
+
+        size_t num_writes() const {return 0;}
+        template <typename Limits>
+        _LockRecordBase::MergeResult merge_into(_LockRecord<Slots>* r, const Limits& limits) const
+        {
+            return r->merge_read_lock_request(m_key, limits.max_requests(), limits.max_writes(),
+                                         limits.exact_keys());
+        }
+        bool compatible_with(const _LockRecord<Slots>* r) const
+        {
+            return r->compatible_with(BasicLockIntention<Slots>::from_read_key(m_key));
+        }
+        BasicLockIntention<Slots> intention() const {return BasicLockIntention<Slots>::from_read_key(m_key);}
+        uint64_t fast_summary() const
+        {
+            return m_key.value() ? _FastPath::summary(uint64_t(1) << m_key.slot(0), 0) : 0;
+        }
+    };
+
+
+    template <size_t Slots>
+    struct _WriteKeyRequest
+    {
+        BasicKey<Slots> m_key;
+        uint8_t m_priority = 0;
+
+        size_t num_writes() const {return 1;}
+        template <typename Limits>
+        _LockRecordBase::MergeResult merge_into(_LockRecord<Slots>* r, const Limits& limits) const
+        {
+            return r->merge_write_lock_request(m_key, limits.max_requests(), limits.max_writes(),
+                                         limits.exact_keys());
+        }
+        bool compatible_with(const _LockRecord<Slots>* r) const
+        {
+            return r->compatible_with(BasicLockIntention<Slots>::from_write_key(m_key));
+        }
+        BasicLockIntention<Slots> intention() const {return BasicLockIntention<Slots>::from_write_key(m_key);}
+        uint64_t fast_summary() const
+        {
+            uint64_t bits = m_key.value() ? uint64_t(1) << m_key.slot(0) : 0;
+            return _FastPath::summary(bits, bits);
+        }
+    };
+
+
+    enum MergeWindowPolicy
+    {
+        // Merge into the first record within the merge window which accepts the request. Like merging into
+        // the queue front, the request may run ahead of conflicting requests queued behind that record.
+        FirstFit = 0,
+        // Only merge into a record if the request is compatible with every record queued behind it so that
+        // conflicting requests always run in the order they were queued.
+        Ordered = 1
+    };
+
+
+    enum RecordOverflow
+    {
+        // Requests take records from the heap once the arena is exhausted, which are freed once released.
+        HeapOverflow = 0,
+        // Blocking and timed requests wait for an arena record, try_ requests fail.
+        BlockOnOverflow = 1,
+        // try_ requests fail, every other request takes a record from the heap.
+        FailOnOverflow = 2
+    };
+
+
+    enum SchedulingPolicy
+    {
+        // Records are activated in queue order.
+        Fifo = 0,
+        // The first queued record which writes is activated ahead of the read only records before it.
+        WriterPreferring = 1,
+        // The first queued read only record is activated ahead of the records which write before it.
+        ReaderPreferring = 2,
+        // The queued record with the highest priority class is activated first, in queue order within a class.
+        PriorityLanes = 3
+    };
+
+
+    struct MergeWindowStats
+    {
+        // merges_at_depth[i] counts the requests merged into the i-th pending record of the lock queue.
+        std::vector<size_t> merges_at_depth;
+        // Requests which were not merged into any record in the window and were queued in a new record.
+        size_t unmerged;
+    };
+
+
+    struct SchedulingStats
+    {
+        // Records activated, and those among them activated ahead of the queue front.
+        size_t activations;
+        size_t promotions;
+        // Records activated because they had been passed over max_bypasses times.
+        size_t bounded_activations;
+        // Most times any record has been passed over.
+        size_t max_bypassed;
+    };
+
+
+    struct BloomFilterLockOptions
+    {
+    /* BloomFilterLockOptions
+     * Run time settings of a BloomFilterLock, set by name on a default constructed instance, e.g.
+     *     BloomFilterLockOptions options;
+     *     options.merge_window = 4;
+     *     BloomFilterLock<> lock(options);
+     */
+        // The number of pending records at the front of the lock queue which keyed requests (multilock,
+        // read_lock and write_lock) are tried against before a new record is queued for them.
+        size_t merge_window = 1;
+        MergeWindowPolicy merge_window_policy = FirstFit;
+
+        /* The number of keyed requests which may join the active record while it is held, instead of waiting
+         * for it to drain, per activation. A request only joins if it is compatible with the active record and
+         * with every record queued behind it, so that it can not delay a queued conflicting request by more
+         * than max_active_joins holders. 0 disables joining.
+         */
+        size_t max_active_joins = 0;
+
+        /* Enables the reader biased mode for global_read_lock: while the bias is set a global read only
+         * registers in the shared table of visible readers and never touches the lock queue. Activating a
+         * record which writes revokes the bias and holds the record back until the biased readers have
+         * drained. The bias is set again by a global read taking the queue once a multiple of the time the
+         * last revocation took has passed, so that write heavy phases do not pay for revoking over and over.
+         */
+        bool read_bias = false;
+
+        /* arena_capacity lock records are allocated in one block up front, record_overflow decides what a
+         * request does once they are all in use. Asynchronous requests, batches and LockSets never wait for a
+         * record and one record is kept back for the spare which keeps the lock queue from running empty,
+         * which only comes from the heap if the arena is exhausted regardless.
+         */
+        size_t arena_capacity = 7;
+        RecordOverflow record_overflow = HeapOverflow;
+
+        /* scheduling picks the record activated once the active one is released, see SchedulingPolicy. A
+         * record is only activated ahead of records it does not conflict with, so conflicting requests are
+         * still granted in queue order. A record may be passed over at most max_bypasses times, after which
+         * it is the next one activated. Records of LockSets are never passed over so that LockSets stay
+         * deadlock free.
+         */
+        SchedulingPolicy scheduling = Fifo;
+        size_t max_bypasses = 8;
+
+        /* Lets blocking, try_ and timed requests and execute take the lock with a single CAS while the lock
+         * queue is idle and the request does not conflict with the other fast path holders, see _FastPath.
+         * It is opt-in and ignored in the reader biased mode. Fast path holders are not held through a lock
+         * record, so unlock(part), downgrade and try_upgrade return false for them, and their acquisitions
+         * are only counted as fast_path_acquisitions in LockStats, not in the wait and hold times.
+         */
+        bool fast_path = false;
+    };
+
+
+    template <size_t MaxRequests = 8, size_t MaxWrites = 8, size_t ExactKeys = 0>
+    struct FixedMergeLimits
+    {
+    /* FixedMergeLimits
+     * Compile time limits on merging requests into a lock record. A record is closed to new requests once more
+     * than MaxRequests have been merged into it, and requests with more than MaxWrites writes always get a
+     * record of their own. Larger limits give bigger batches at the cost of a higher bloom filter false
+     * conflict rate. With ExactKeys > 0 records with up to ExactKeys keys, at most
+     * BasicLockIntention::max_exact_keys, confirm bloom filter conflicts against the keys themselves.
+     */
+        static constexpr size_t max_requests() {return MaxRequests;}
+        static constexpr size_t max_writes() {return MaxWrites;}
+        static constexpr size_t exact_keys() {return ExactKeys;}
+        template <typename Queue>
+        void observe(_LockRecordBase::MergeResult, const Queue&) {}
+    };
+
+
+    template <size_t MinLimit = 2, size_t MaxLimit = 32, size_t InitialLimit = 8, size_t ExactKeys = 6>
+    class AdaptiveMergeLimits
+    {
+    /* AdaptiveMergeLimits
+     * Merge limits tuned at runtime between MinLimit and MaxLimit. The same limit is used for the number of
+     * requests per record and the number of writes per request. Every SampleInterval merge attempts the
+     * share of bloom filter false conflicts is checked: a high share narrows the limit, as fuller records
+     * are more likely to conflict falsely, while a low share combined with a deep queue widens it to batch
+     * more requests per record. ExactKeys is as for FixedMergeLimits. A false conflict is a bit conflict the
+     * exact keys show not to overlap, and one they could not check as the keys of a side are not kept,
+     * which is what narrowing the limit reduces. Conflicts confirmed on the exact keys are real contention
+     * a narrower limit does not help and are not counted. With ExactKeys = 0 no conflict can be checked and
+     * every conflict is counted. observe is only called under the mutex in BloomFilterLock, the limit is
+     * also read without it by requests queued in a record of their own.
+     */
+    public:
+        static_assert(MinLimit > 0 && MinLimit <= InitialLimit && InitialLimit <= MaxLimit, "Invalid merge limits");
+
+        AdaptiveMergeLimits():
+            m_limit(InitialLimit),
+            m_attempts(0),
+            m_false_conflicts(0)
+        {}
+
+        size_t max_requests() const {return m_limit.load(std::memory_order_relaxed);}
+        size_t max_writes() const {return m_limit.load(std::memory_order_relaxed);}
+        static constexpr size_t exact_keys() {return ExactKeys;}
+
+        template <typename Queue>
+        void observe(_LockRecordBase::MergeResult result, const Queue& queue)
+        {
+            m_false_conflicts += (result == _LockRecordBase::MergedOnExactKeys ||
+                            result == _LockRecordBase::RejectedConflict);
+            if (++m_attempts < SampleInterval)
+                return;
+
+            auto limit = m_limit.load(std::memory_order_relaxed);
+            if (m_false_conflicts * 2 > m_attempts)
+            {
+                m_limit.store(std::max(limit - limit / 4 - 1, MinLimit), std::memory_order_relaxed);
+            }
+            else if (m_false_conflicts * 8 < m_attempts && _queue_depth(queue, DeepQueue) >= DeepQueue)
+            {
+                m_limit.store(std::min(limit + limit / 4 + 1, MaxLimit), std::memory_order_relaxed);
+            }
+            m_attempts = 0;
+            m_false_conflicts = 0;
+        }
+
+    private:
+        static constexpr size_t SampleInterval = 128;
+        static constexpr size_t DeepQueue = 4;
+
+        template <typename Queue>
+        static size_t _queue_depth(const Queue& queue, size_t max_depth)
+        {
+            size_t depth = 0;
+            for (auto r = queue.front(); r && depth < max_depth; r = queue.next(r))
+                depth += (r->record_type() != _LockRecordBase::None);
+            return depth;
+        }
+
+        std::atomic<size_t> m_limit;
+        size_t m_attempts;
+        size_t m_false_conflicts;
+    };
+
+
+    struct LockStats
+    {
+    /* LockStats
+     * Snapshot of the counters of an instrumented BloomFilterLock. Front merges are keyed requests
+     * merged into the record at the front of the lock queue, back merges the ones merged into records
+     * behind it. Hold times are measured per record, from its activation until its last holder unlocks.
+     * Wait times and parked waiters cover the blocking lock functions. Fast path acquisitions bypass the
+     * lock queue, so they are not counted by any of the others.
+     */
+        static constexpr size_t num_buckets = 32;
+
+        uint64_t front_merges;
+        uint64_t front_merge_rejections;
+        uint64_t back_merges;
+        uint64_t back_merge_rejections;
+        uint64_t pooled_records;
+        uint64_t allocated_records;
+        uint64_t records_closed_by_limit;
+        uint64_t parked_waiters;
+        uint64_t max_queue_depth;
+        uint64_t fast_path_acquisitions;
+        // Bucket i counts durations of [2^i, 2^(i+1)) nanoseconds, the last one also counts longer ones.
+        std::array<uint64_t, num_buckets> wait_time_histogram;
+        std::array<uint64_t, num_buckets> hold_time_histogram;
+    };
+
+
+    struct NoInstrumentation
+    {
+    /* NoInstrumentation
+     * Default instrumentation policy of BloomFilterLock. All hooks compile away and stats() is empty.
+     */
+        static constexpr bool enabled = false;
+
+        uint64_t now() const {return 0;}
+        void merge_attempt(bool, bool) {}
+        void record_allocated(bool) {}
+        void record_closed_by_limit() {}
+        void queue_depth(size_t) {}
+        void waited(uint64_t, bool) {}
+        void held(uint64_t) {}
+        void fast_path_acquired() {}
+        LockStats snapshot() const {return LockStats();}
+    };
+
+
+    template <size_t NumStripes = 16>
+    class StripedInstrumentation
+    {
+    /* StripedInstrumentation
+     * Counts lock events in NumStripes cache line aligned stripes. Each thread is assigned a stripe
+     * round robin, so counting does not share cache lines between threads unless there are more
+     * threads than stripes. snapshot sums the stripes and is not atomic with respect to concurrent
+     * events. The hooks are called by BloomFilterLock, times are in steady_clock nanoseconds.
+     */
+    public:
+        static constexpr bool enabled = true;
+
+        StripedInstrumentation():
+            m_stripes()
+        {}
+
+        uint64_t now() const
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        void merge_attempt(bool front, bool merged)
+        {
+            _increment(front ? (merged ? FrontMerges : FrontMergeRejections) : (merged ? BackMerges : BackMergeRejections));
+        }
+
+        void record_allocated(bool pooled)
+        {
+            _increment(pooled ? PooledRecords : AllocatedRecords);
+        }
+
+        void record_closed_by_limit()
+        {
+            _increment(RecordsClosedByLimit);
+        }
+
+        void queue_depth(size_t depth)
+        {
+            auto& max_depth = _stripe().m_counters[MaxQueueDepth];
+            uint64_t current = max_depth.load(std::memory_order_relaxed);
+            while (depth > current && not max_depth.compare_exchange_weak(current, depth, std::memory_order_relaxed));
+        }
+
+        void waited(uint64_t start, bool parked)
+        {
+            if (parked)
+                _increment(ParkedWaiters);
+            _stripe().m_wait_times[_bucket(now() - start)].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void held(uint64_t activation_time)
+        {
+            _stripe().m_hold_times[_bucket(now() - activation_time)].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void fast_path_acquired()
+        {
+            _increment(FastPathAcquisitions);
+        }
+
+        LockStats snapshot() const
+        {
+            uint64_t counters[NumCounters] = {};
+            LockStats result = LockStats();
+            for (auto& stripe: m_stripes)
+            {
+                for (size_t i = 0; i < NumCounters; ++i)
+                {
+                    auto value = stripe.m_counters[i].load(std::memory_order_relaxed);
+                    counters[i] = (i == MaxQueueDepth) ? std::max(counters[i], value) : counters[i] + value;
+                }
+                for (size_t i = 0; i < LockStats::num_buckets; ++i)
+                {
+                    result.wait_time_histogram[i] += stripe.m_wait_times[i].load(std::memory_order_relaxed);
+                    result.hold_time_histogram[i] += stripe.m_hold_times[i].load(std::memory_order_relaxed);
+                }
+            }
+            result.front_merges = counters[FrontMerges];
+            result.front_merge_rejections = counters[FrontMergeRejections];
+            result.back_merges = counters[BackMerges];
+            result.back_merge_rejections = counters[BackMergeRejections];
+            result.pooled_records = counters[PooledRecords];
+            result.allocated_records = counters[AllocatedRecords];
+            result.records_closed_by_limit = counters[RecordsClosedByLimit];
+            result.parked_waiters = counters[ParkedWaiters];
+            result.max_queue_depth = counters[MaxQueueDepth];
+            result.fast_path_acquisitions = counters[FastPathAcquisitions];
+            return result;
+        }
+
+    private:
+        enum Counter
+        {
+            FrontMerges = 0,
+            FrontMergeRejections,
+            BackMerges,
+            BackMergeRejections,
+            PooledRecords,
+            AllocatedRecords,
+            RecordsClosedByLimit,
+            ParkedWaiters,
+            MaxQueueDepth,
+            FastPathAcquisitions,
+            NumCounters
+        };
+
+        struct alignas(_cache_line_size) _Stripe
+        {
+            std::atomic<uint64_t> m_counters[NumCounters];
+            std::atomic<uint64_t> m_wait_times[LockStats::num_buckets];
+            std::atomic<uint64_t> m_hold_times[LockStats::num_buckets];
+        };
+
+        static size_t _bucket(uint64_t duration)
+        {
+            return duration ? std::min<size_t>(63 - __builtin_clzll(duration), LockStats::num_buckets - 1) : 0;
+        }
+
+        _Stripe& _stripe()
+        {
+            static std::atomic<size_t> next_stripe(0);
+            thread_local size_t stripe = next_stripe.fetch_add(1, std::memory_order_relaxed) % NumStripes;
+            return m_stripes[stripe];
+        }
+
+        void _increment(Counter counter)
+        {
+            _stripe().m_counters[counter].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        _Stripe m_stripes[NumStripes];
+    };
+
+
+    template <typename Base = NoInstrumentation>
+    struct UsdtInstrumentation: Base
+    {
+    /* UsdtInstrumentation
+     * Adds the trace hooks of BloomFilterLock to the Base instrumentation policy and fires a USDT probe of the
+     * bloomfilter_lock provider from each, for perf and bpftrace to attach to, e.g.
+     *     bpftrace -e 'usdt:./app:bloomfilter_lock:merge /arg2 > 1/ {@rejects[arg2] = count();}'
+     * An unattached probe is a nop. The hooks are only called by locks whose instrumentation sets tracing, so
+     * any other policy can observe the same events by defining them, the default policies cost nothing.
+     * record is the address of a lock record, which is reused once the record is released, type its RecordType
+     * and summary the slot 0 summary of the keys of a record or request, see _FastPath. trace_merge gets the
+     * MergeResult of a keyed request tried against a record, RejectedConflict includes prefix conflicts and
+     * the conflicts of locks which keep no exact keys.
+     * trace_wait fires once a blocking waiter holds the lock, parked if it had to park on the record futex.
+     * An activated record owes its parked waiters a FUTEX_WAKE, which is issued after trace_activate once the
+     * activating thread has left the internal locks. trace_wake fires from that thread when the syscall
+     * returns, with the number of threads it woke, which is at most the wake fanout, see ChainedWakeWaitPolicy.
+     */
+        static constexpr bool tracing = true;
+
+        void trace_enqueue(const void* record, int type, uint64_t summary)
+        {
+            _BLOOMFILTER_LOCK_PROBE3(enqueue, record, type, summary);
+        }
+
+        void trace_merge(const void* record, uint64_t summary, _LockRecordBase::MergeResult result)
+        {
+            _BLOOMFILTER_LOCK_PROBE3(merge, record, summary, int(result));
+        }
+
+        void trace_activate(const void* record, int type, uint64_t summary)
+        {
+            _BLOOMFILTER_LOCK_PROBE3(activate, record, type, summary);
+        }
+
+        void trace_wait(const void* record, bool parked)
+        {
+            _BLOOMFILTER_LOCK_PROBE2(wait, record, int(parked));
+        }
+
+        void trace_release(const void* record)
+        {
+            _BLOOMFILTER_LOCK_PROBE1(release, record);
+        }
+
+        void trace_wake(const void* record, int woken)
+        {
+            _BLOOMFILTER_LOCK_PROBE2(wake, record, woken);
+        }
+    };
+
+
+    // True if the instrumentation policy I has the trace hooks of UsdtInstrumentation.
+    template <typename I, typename = void>
+    struct _traces: std::false_type {};
+
+    template <typename I>
+    struct _traces<I, std::void_t<decltype(I::tracing)>>: std::integral_constant<bool, I::tracing> {};
+
+
+    struct _InlineExecutor
+    {
+        template <typename F>
+        void operator()(F&& f) const {f();}
+    };
+
+
+    template <typename Callback, typename Executor>
+    struct _AsyncCallbackWaiter: _AsyncWaiter
+    {
+        _AsyncCallbackWaiter(Callback&& callback, Executor&& executor):
+            _AsyncWaiter{nullptr, &_AsyncCallbackWaiter::resume},
+            m_callback(std::move(callback)),
+            m_executor(std::move(executor))
+        {}
+
+        static void resume(_AsyncWaiter* self)
+        {
+            std::unique_ptr<_AsyncCallbackWaiter> waiter(static_cast<_AsyncCallbackWaiter*>(self));
+            waiter->m_executor(std::move(waiter->m_callback));
+        }
+
+        Callback m_callback;
+        Executor m_executor;
+    };
+
+
+    template <typename LockType, typename Fn>
+    struct _ExecuteWaiter: _AsyncWaiter
+    {
+    /* _ExecuteWaiter
+     * Request of BloomFilterLock::execute, lives on the stack of the submitter. Runs the closure of the
+     * submitter on the thread which activates its record and then releases the record for it.
+     */
+        _ExecuteWaiter(LockType& lock, Fn& fn):
+            _AsyncWaiter{nullptr, &_ExecuteWaiter::resume},
+            m_lock(lock),
+            m_fn(fn)
+        {}
+
+        static void resume(_AsyncWaiter* self)
+        {
+            auto waiter = static_cast<_ExecuteWaiter*>(self);
+            waiter->run();
+            // The submitter may return, and free the waiter, as soon as it sees the signal.
+            waiter->m_done.signal();
+        }
+
+        void run()
+        {
+            try
+            {
+                m_fn();
+            }
+            catch (...)
+            {
+                m_exception = std::current_exception();
+            }
+            m_lock.async_unlock();
+        }
+
+        LockType& m_lock;
+        Fn& m_fn;
+        std::exception_ptr m_exception;
+        _FutexWrapper m_done;
+    };
+
+
+#if defined(__cpp_impl_coroutine)
+    template <typename LockType, typename Request, typename Executor = _InlineExecutor>
+    class _LockAwaiter: _AsyncWaiter
+    {
+    /* _LockAwaiter
+     * Awaitable returned by the coroutine lock functions. The awaiting coroutine is only suspended if
+     * the request could not be granted straight away.
+     */
+    public:
+        _LockAwaiter(LockType& lock, Request request, Executor executor = Executor()):
+            _AsyncWaiter{nullptr, &_LockAwaiter::resume},
+            m_lock(lock),
+            m_request(request),
+            m_executor(std::move(executor))
+        {}
+
+        template <typename OtherExecutor>
+        _LockAwaiter<LockType, Request, OtherExecutor> via(OtherExecutor executor) const
+        {
+            return _LockAwaiter<LockType, Request, OtherExecutor>(m_lock, m_request, std::move(executor));
+        }
+
+        bool await_ready() const noexcept {return false;}
+
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            m_handle = handle;
+            return m_lock.async_lock_request(m_request, this);
+        }
+
+        void await_resume() const noexcept {}
+
+    private:
+        static void resume(_AsyncWaiter* self)
+        {
+            // Resuming can destroy the awaiter.
+            auto awaiter = static_cast<_LockAwaiter*>(self);
+            auto handle = awaiter->m_handle;
+            auto executor = std::move(awaiter->m_executor);
+            executor([handle]() {handle.resume();});
+        }
+
+        LockType& m_lock;
+        Request m_request;
+        Executor m_executor;
+        std::coroutine_handle<> m_handle;
+    };
+#endif
+
+
+    template <typename LockType>
+    class BatchHandle
+    {
+    /* BatchHandle
+     * One request queued by BloomFilterLock::multilock_batch. wait() blocks until the request holds the lock
+     * and unlock() releases it again, both from any thread, since like asynchronous holders handles are not
+     * tracked per thread. A record can not drain before every request in it has been waited on and released,
+     * so each handle must be waited on and unlocked, a handle destroyed before that terminates.
+     */
+    public:
+        BatchHandle() = default;
+        BatchHandle(const BatchHandle& rhs) = delete;
+        BatchHandle& operator = (const BatchHandle& rhs) = delete;
+
+        BatchHandle(BatchHandle&& rhs) noexcept:
+            m_lock(rhs.m_lock),
+            m_record(rhs.m_record),
+            m_start(rhs.m_start),
+            m_index(rhs.m_index),
+            m_state(rhs.m_state)
+        {
+            rhs.m_state = Released;
+        }
+
+        BatchHandle& operator = (BatchHandle&& rhs) noexcept
+        {
+            if (m_state != Released)
+                std::terminate();
+            m_lock = rhs.m_lock;
+            m_record = rhs.m_record;
+            m_start = rhs.m_start;
+            m_index = rhs.m_index;
+            m_state = rhs.m_state;
+            rhs.m_state = Released;
+            return *this;
+        }
+
+        ~BatchHandle()
+        {
+            if (m_state != Released)
+                std::terminate();
+        }
+
+        void wait()
+        {
+            if (m_state != Queued)
+                std::terminate();
+            m_lock->wait_on(m_record, m_start);
+            m_state = Held;
+        }
+
+        void unlock()
+        {
+            // The record of a held handle is the active record or was absorbed into it, both are released
+            // with the active record.
+            if (m_state != Held || not m_record->activated())
+                std::terminate();
+            m_state = Released;
+            m_lock->release_active_record();
+        }
+
+        bool held() const {return m_state == Held;}
+        // The position of the intention in the batch.
+        size_t index() const {return m_index;}
+
+    private:
+        friend LockType;
+        enum State {Queued, Held, Released};
+
+        LockType* m_lock = nullptr;
+        typename LockType::Record* m_record = nullptr;
+        uint64_t m_start = 0;
+        size_t m_index = 0;
+        State m_state = Released;
+    };
+
+
+    // Deadlines of the timed lock functions are kept on steady_clock, which FUTEX_WAIT timeouts follow.
+    inline std::chrono::steady_clock::time_point _steady_deadline(std::chrono::steady_clock::time_point deadline)
+    {
+        return deadline;
+    }
+
+    template <typename Clock, typename Duration>
+    std::chrono::steady_clock::time_point _steady_deadline(const std::chrono::time_point<Clock, Duration>& deadline)
+    {
+        return std::chrono::steady_clock::now() +
+               std::chrono::duration_cast<std::chrono::steady_clock::duration>(deadline - Clock::now());
+    }
+
+    template <typename Rep, typename Period>
+    std::chrono::steady_clock::time_point _steady_deadline(const std::chrono::duration<Rep, Period>& timeout)
+    {
+        return std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout);
+    }
+
+
+    /* Table of visible readers shared by the reader biased BloomFilterLocks, after BRAVO (Dice and Kogan,
+     * "BRAVO - Biased Locking for Reader-Writer Locks"). A thread holding a biased global read stores the
+     * lock in the entry picked by _visible_reader_index, so readers of a lock never write to the lock itself.
+     */
+    constexpr size_t _num_visible_readers = 4096;
+
+    inline std::atomic<const void*>* _visible_readers()
+    {
+        static std::atomic<const void*> visible_readers[_num_visible_readers];
+        return visible_readers;
+    }
+
+    inline size_t _visible_reader_index(const void* lock)
+    {
+        // Threads are spread a cache line of entries apart, locks by a multiplicative hash of their address.
+        static std::atomic<size_t> next_thread_index(0);
+        static thread_local size_t thread_index = next_thread_index.fetch_add(1, std::memory_order_relaxed);
+        auto lock_hash = size_t((reinterpret_cast<uintptr_t>(lock) >> 6) * 0x9E3779B97F4A7C15ull >> 32);
+        return (thread_index * (_cache_line_size / sizeof(void*)) + lock_hash) % _num_visible_readers;
+    }
+
+
+    template <typename InternalLockType=std::mutex, typename WaitPolicy=FutexWaitPolicy,
+              typename MergePolicy=FixedMergeLimits<>, typename Instrumentation=NoInstrumentation,
+              size_t KeySlots=4, typename Tracking=ScanTracking>
+    class BloomFilterLock
+    {
+    public:
+        // KeySlots selects the key width, see BasicKey. Tracking is one of the tracking policies above.
+        typedef BasicKey<KeySlots> KeyType;
+        typedef BasicLockIntention<KeySlots> IntentionType;
+        
+        // See BloomFilterLockOptions.
+        explicit BloomFilterLock(const BloomFilterLockOptions& options = BloomFilterLockOptions());
+        BloomFilterLock(const BloomFilterLock& rhs) = delete;
+        BloomFilterLock& operator = (const BloomFilterLock& rhs) = delete;
+        ~BloomFilterLock();
+
+        // priority is the class of the request under PriorityLanes, higher classes are activated first.
+        void global_read_lock(uint8_t priority = 0);
+        void global_write_lock(uint8_t priority = 0);
+        
+        template <typename T>
+        void multilock(const T& reads, const T& writes);
+        void multilock(const IntentionType& l, uint8_t priority = 0);
+        void read_lock(KeyType readKey);
+        void write_lock(KeyType writeKey);
+
+        /* The try_ variants never wait for another holder. They succeed on the fast path while it is
+         * enabled and the request does not conflict with its holders, see BloomFilterLockOptions::fast_path,
+         * by merging into the queue front when no record is active, which activates it at once, or by
+         * joining the active record like blocking requests do, see max_active_joins. They fail otherwise.
+         */
+        template <typename T>
+        bool try_multilock(const T& reads, const T& writes);
+        bool try_multilock(const IntentionType& l);
+        bool try_read_lock(KeyType readKey);
+        bool try_write_lock(KeyType writeKey);
+
+        /* The timed variants queue like their blocking counterparts and return false if the lock was not
+         * acquired in time. A request which timed out leaves its bits merged in its record, which can only
+         * cause false conflicts for the other requests of that record.
+         */
+        template <typename Rep, typename Period>
+        bool multilock_for(const IntentionType& l, const std::chrono::duration<Rep, Period>& timeout);
+        template <typename Clock, typename Duration>
+        bool multilock_until(const IntentionType& l, const std::chrono::time_point<Clock, Duration>& deadline);
+        template <typename Rep, typename Period>
+        bool read_lock_for(KeyType readKey, const std::chrono::duration<Rep, Period>& timeout);
+        template <typename Clock, typename Duration>
+        bool read_lock_until(KeyType readKey, const std::chrono::time_point<Clock, Duration>& deadline);
+        template <typename Rep, typename Period>
+        bool write_lock_for(KeyType writeKey, const std::chrono::duration<Rep, Period>& timeout);
+        template <typename Clock, typename Duration>
+        bool write_lock_until(KeyType writeKey, const std::chrono::time_point<Clock, Duration>& deadline);
+
+        void unlock();
+
+        /* Partial releases give back part of the request held by the calling thread, which still has to
+         * unlock() in the end. The lock record counts the keys setting each of its bits, so the bits of the
+         * given back keys are cleared once no other holder needs them. Queued records which no longer
+         * conflict with what is left are then activated as part of the held record and later requests can
+         * join it, see max_active_joins. unlock(key) gives back a read on key, writes are given back with
+         * unlock(part). Only keys an intention keeps can be given back, see BasicLockIntention; requests with
+         * prefix keys or more keys than that hold their bits until the final unlock(). Both return false and
+         * give back nothing unless every key of part is held by the request of the thread in the same mode,
+         * which excludes fast path holders, biased global reads, asynchronous or batch holders and locks
+         * using NoTracking, see the Tracking policies.
+         */
+        bool unlock(KeyType key);
+        bool unlock(const IntentionType& part);
+
+        /* downgrade and try_upgrade change the request held by the calling thread without giving up its
+         * place. downgrade drops the writes of the held request, reads_only is the intention it keeps and
+         * must only keep keys of the held request. The write bits are given back like with unlock(part),
+         * queued records which no longer conflict are then activated and later compatible readers can join
+         * the record, see max_active_joins. A request with prefix keys or more keys than an intention keeps
+         * can only be downgraded while it is the sole holder of the active record, downgrade returns false
+         * and leaves the request as it is otherwise. try_upgrade adds a write on key, which the request may
+         * already read. It returns false if another holder of the active record may read key, which for a
+         * shared record is only ruled out by its exact keys, see FixedMergeLimits. Both only apply to
+         * requests the thread holds through a lock record and return false for fast path holders, biased
+         * global reads, asynchronous or batch holders and locks using NoTracking.
+         */
+        bool downgrade(const IntentionType& reads_only);
+        bool try_upgrade(KeyType key);
+
+        /* Asynchronous variants for callers which must not block their thread. The request is queued and
+         * merged like its blocking counterpart and callback is invoked once the lock is held: inline if the
+         * lock is acquired straight away, otherwise by the thread which activates the record, outside of
+         * the internal locks, or through executor(callback) if an executor is given. Asynchronous holders
+         * are not tracked per thread, may release from any thread and must release with async_unlock.
+         */
+        template <typename Callback>
+        void async_multilock(const IntentionType& l, Callback callback);
+        template <typename Callback, typename Executor>
+        void async_multilock(const IntentionType& l, Callback callback, Executor executor);
+        template <typename Callback>
+        void async_read_lock(KeyType readKey, Callback callback);
+        template <typename Callback, typename Executor>
+        void async_read_lock(KeyType readKey, Callback callback, Executor executor);
+        template <typename Callback>
+        void async_write_lock(KeyType writeKey, Callback callback);
+        template <typename Callback, typename Executor>
+        void async_write_lock(KeyType writeKey, Callback callback, Executor executor);
+#if defined(__cpp_impl_coroutine)
+        /* co_await lock.async_multilock(l) suspends the coroutine until the lock is held.
+         * co_await lock.async_multilock(l).via(executor) resumes it through executor. l must outlive the
+         * co_await expression.
+         */
+        _LockAwaiter<BloomFilterLock, _IntentionRequest<KeySlots>> async_multilock(const IntentionType& l);
+        _LockAwaiter<BloomFilterLock, _ReadKeyRequest<KeySlots>> async_read_lock(KeyType readKey);
+        _LockAwaiter<BloomFilterLock, _WriteKeyRequest<KeySlots>> async_write_lock(KeyType writeKey);
+#endif
+        void async_unlock();
+
+        /* execute runs fn while holding l and returns once fn has run, rethrowing anything fn threw. If the
+         * lock is not acquired straight away, fn is run by the thread which activates its record, one after
+         * another with the closures of the other execute requests merged into the record, which are all
+         * compatible. Tiny critical sections then cost one wake of the submitter once they are done instead
+         * of waking it into the lock and counting it back out. With the fast path enabled an uncontended
+         * request runs fn in place, see BloomFilterLockOptions::fast_path. fn runs outside of the internal
+         * locks, on an arbitrary thread, and must not lock this BloomFilterLock.
+         */
+        template <typename Fn>
+        void execute(const IntentionType& l, Fn&& fn);
+
+        /* multilock_batch queues independent intentions in one hold of the internal lock and returns a handle
+         * per intention, see BatchHandle. Each one first tries to join the active record and, under Fifo
+         * scheduling, to merge into the merge window like multilock. It then packs into the records queued for
+         * the batch so far, first fit, and only then gets a record of its own at the back of the queue. Under
+         * the Ordered merge window policy it only packs into batch records with no conflicting record queued
+         * behind them. Intentions of a batch which conflict end up in different records.
+         * The handles are returned in the order their records are activated, index() is the position of the
+         * intention of a handle. Only one record is active at a time, so a thread taking several handles must
+         * take them in that order and unlock each before waiting on the next. For that the records allocated
+         * for a batch are never passed over by the scheduling policy, like those of LockSets, and under other
+         * policies than Fifo the batch does not merge into records queued before it, which may be.
+         */
+        std::vector<BatchHandle<BloomFilterLock>> multilock_batch(const std::vector<IntentionType>& intentions);
+
+        MergeWindowStats merge_window_stats();
+        SchedulingStats scheduling_stats();
+        // Empty unless the lock is instrumented, see StripedInstrumentation.
+        LockStats stats() const;
+
+        /* Grows the arena to capacity records with another block, e.g. to the peak an instrumented lock
+         * has observed: reserve_records(stats().max_queue_depth + 2) covers the active record and its spare.
+         */
+        void reserve_records(size_t capacity);
+        size_t record_capacity() const;
+
+    private:
+        typedef _LockRecord<KeySlots> Record;
+
+        Record *allocate_lock_record();
+        // Takes reserved if it is set, a record from the arena or the heap otherwise.
+        Record *allocate_lock_record(Record*& reserved);
+        // For BlockOnOverflow, returns nullptr if the deadline passed first.
+        Record *wait_for_record(std::chrono::steady_clock::time_point deadline);
+        bool records_exhausted();
+        void free_lock_record(Record* r);
+        static void delete_lock_record(Record* r);
+        _AsyncWaiter* activate_queue_front(Record*& spare);
+        // m_mutex must be held. Returns the record the scheduling policy activates next, front or a record
+        // behind it, and sets prev to the record queued ahead of it.
+        Record* schedule(Record* front, Record*& prev);
+
+        template <typename Request>
+        void lock_request(const Request& request);
+        template <typename Request>
+        bool try_lock_request(const Request& request);
+        template <typename Request>
+        bool lock_request_until(const Request& request, std::chrono::steady_clock::time_point deadline);
+        // reserved is a record taken up front for the request, which enqueue_request takes ownership of.
+        template <typename Request>
+        Record* enqueue_request(const Request& request, Record* reserved = nullptr);
+        template <typename Request>
+        bool async_lock_request(const Request& request, _AsyncWaiter* waiter);
+        template <typename Request, typename Callback, typename Executor>
+        void async_lock_request(const Request& request, Callback&& callback, Executor&& executor);
+        void release_active_record();
+        _AsyncWaiter* absorb_queue_front(Record* active);
+
+        template <typename LockType, typename Request, typename Executor>
+        friend class _LockAwaiter;
+        template <typename LockType>
+        friend class BatchHandle;
+        template <typename Request>
+        Record* merge_in_window(const Request& request);
+        // m_mutex must be held. Merges the request into one of batch, the records queued by multilock_batch
+        // in queue order, and returns it or nullptr.
+        template <typename Request>
+        Record* pack_batch_request(const Request& request, const std::vector<Record*>& batch);
+        template <typename Request>
+        bool merge_into(const Request& request, Record* r);
+        template <typename Request>
+        Record* join_active_record(const Request& request);
+
+        // Reader bias, see BloomFilterLockOptions.
+        bool try_biased_read_lock();
+        void release_biased_read_lock();
+
+        inline bool try_fast_lock(uint64_t summary)
+        {
+            if (not _FastPath::try_acquire(m_fast_state, summary))
+                return false;
+            m_instrumentation.fast_path_acquired();
+            return true;
+        }
+
+        void release_fast_lock();
+        // m_mutex must be held. Closes the fast path and returns true if no fast path holders remain.
+        inline bool close_fast_path()
+        {
+            return not m_fast_path_enabled || not _FastPath::close(m_fast_state);
+        }
+        void restore_read_bias();
+        bool revoke_read_bias();
+        void end_revocation();
+        bool biased_readers_present() const;
+
+        /* The latch_ functions add the caller as a waiter on a record and return the record, which the caller
+         * then waits on. They release guard.
+         */
+        inline Record* latch_in_queue(std::unique_lock<InternalLockType>& guard, Record * r)
+        {
+            // r is already in the queue.
+            r->_latch();            
+                        
+            _AsyncWaiter* activated = nullptr;
+            Record* spare = nullptr;
+            if (!m_active_lock_record.load(std::memory_order_relaxed))
+                activated = activate_queue_front(spare);
+
+            guard.unlock();
+            _AsyncWaiter::resume_all(activated);
+            if (spare)
+                free_lock_record(spare);
+            return r;
+        }
+
+        inline Record* latch_at_queue_front(std::unique_lock<InternalLockType>& guard)
+        {
+            return latch_in_queue(guard, m_lock_queue.front());
+        }
+
+        inline Record* latch_at_queue_back(std::unique_lock<InternalLockType>& guard, Record * new_record)
+        {
+            trace_enqueue(new_record);
+            m_lock_queue.push(new_record);
+            return latch_in_queue(guard, new_record);
+        }
+        
+        /* Enqueues a request which could not have been merged into the queue front without taking m_mutex.
+         * new_record must already hold the request.
+         */
+        inline Record* latch_at_queue_back(Record * new_record)
+        {
+            trace_enqueue(new_record);
+            new_record->_latch();
+            m_lock_queue.push(new_record);
+            activate_if_idle();
+            return new_record;
+        }
+
+        // Called after pushing to the queue without m_mutex.
+        inline void activate_if_idle()
+        {
+            // An unlock which found the queue empty after clearing the active record can not have
+            // seen the push, in which case it is up to the pushing thread to activate the queue.
+            if (not m_active_lock_record.load(std::memory_order_seq_cst))
+            {
+                std::unique_lock<InternalLockType> guard(m_mutex);
+                _AsyncWaiter* activated = nullptr;
+                Record* spare = nullptr;
+                if (not m_active_lock_record.load(std::memory_order_relaxed))
+                    activated = activate_queue_front(spare);
+                guard.unlock();
+                _AsyncWaiter::resume_all(activated);
+                if (spare)
+                    free_lock_record(spare);
+            }
+        }
+
+        template <typename LockType>
+        friend class LockSet;
+        // Queues l in a record of its own at the back of the queue for a LockSet. The record is latched but
+        // the caller has to activate_if_idle.
+        Record* push_request(const IntentionType& l);
+
+        bool wait_until(Record* r, std::chrono::steady_clock::time_point deadline);
+
+        // start is the time the request was made, as returned by m_instrumentation.now().
+        inline void wait_on(Record* r, uint64_t start)
+        {
+            bool parked = r->wait(m_wait_policy);
+            m_instrumentation.waited(start, parked);
+            if constexpr (_traces<Instrumentation>::value)
+                m_instrumentation.trace_wait(r, parked);
+        }
+
+        // The trace hooks compile away unless the instrumentation traces, see UsdtInstrumentation.
+        static uint64_t trace_summary(const Record* r)
+        {
+            // Global requests leave the record intention empty.
+            if (r->record_type() == Record::ReadOnly)
+                return _FastPath::AllAccesses;
+            if (r->record_type() == Record::Exclusive && not r->m_num_requests)
+                return _FastPath::AllAccesses | _FastPath::AllWrites;
+            return _FastPath::summary(r->m_lock_intention.m_read_indicators[0], r->m_lock_intention.m_write_indicators[0]);
+        }
+
+        inline void trace_enqueue(const Record* r)
+        {
+            if constexpr (_traces<Instrumentation>::value)
+                m_instrumentation.trace_enqueue(r, r->record_type(), trace_summary(r));
+        }
+
+        inline void trace_activate(Record* r)
+        {
+            if constexpr (_traces<Instrumentation>::value)
+            {
+                m_instrumentation.trace_activate(r, r->record_type(), trace_summary(r));
+                // The FUTEX_WAKE owed by the activation is traced by the thread issuing it.
+                r->m_wake.m_trace = &trace_wake;
+                r->m_wake.m_tracer = &m_instrumentation;
+            }
+        }
+
+        static void trace_wake(void* instrumentation, const void* record, int woken)
+        {
+            static_cast<Instrumentation*>(instrumentation)->trace_wake(record, woken);
+        }
+
+        // The locks on which the thread holds a biased global read, kept whatever the tracking policy.
+        // Function local so that every instantiation gets its own guard, g++ 12 emits clashing guards for
+        // thread_local static members of several instantiations of a class template.
+        static _TLResourceTracker<BloomFilterLock>& tl_biased_reads()
+        {
+            static thread_local _TLResourceTracker<BloomFilterLock> biased_reads;
+            return biased_reads;
+        }
+
+        // Keeps the request the calling thread now holds through r, see _HeldIntention.
+        void hold_request(const IntentionType& l, Record* r, bool global_write = false)
+        {
+            m_tracking.template hold<KeySlots>(_HeldIntention<KeySlots>{this, r, global_write, l});
+        }
+
+        template <typename Request>
+        void hold_request(const Request& request, Record* r)
+        {
+            hold_request(request.intention(), r);
+        }
+
+        // Returns the request the calling thread holds through the active record, if any. m_mutex must be held.
+        _HeldIntention<KeySlots>* held_request(Record*& active);
+
+        std::atomic<Record*> m_active_lock_record;
+        std::vector<Record*> m_record_pool;
+        _LockQueue<Record> m_lock_queue;
+        alignas(_cache_line_size) InternalLockType m_mutex; // For locking internal structures.
+        _SpinLock m_pool_lock; // For locking m_record_pool so that records can be allocated outside m_mutex.
+        // Guarded by m_pool_lock.
+        std::vector<std::unique_ptr<Record[]>> m_arena;
+        std::atomic<size_t> m_arena_capacity;
+        size_t m_record_waiters;
+        std::condition_variable_any m_record_freed;
+        const RecordOverflow m_record_overflow;
+        alignas(_cache_line_size) WaitPolicy m_wait_policy;
+        MergePolicy m_merge_policy; // Guarded by m_mutex.
+        Instrumentation m_instrumentation;
+        /* Track the set of resource locks held by each thread.  This is here to prevent an attempt to make a lock
+         * request on a BloomFilterLock through which some resources are already locked.  That pattern is not permissible
+         * via the resource_lock scheme.  An exception results if that occurs.  Consider a set of item Keys
+         * which can all be locked collectively via their controlling Key instead in that case.
+         */
+        Tracking m_tracking;
+        bool m_closing; // Set to true during the destructor sequence.        
+
+        const size_t m_merge_window;
+        const MergeWindowPolicy m_merge_window_policy;
+        const size_t m_max_active_joins;
+        // Guarded by m_mutex.
+        size_t m_active_joins; // Requests which joined the current active record.
+        std::vector<size_t> m_merges_at_depth;
+        std::vector<Record*> m_window_records;
+        // Requests queued without a merge, including the ones queued without m_mutex.
+        std::atomic<size_t> m_unmerged;
+
+        const bool m_read_bias_enabled;
+        // Read by every biased global read, written once per revocation.
+        alignas(_cache_line_size) std::atomic<bool> m_read_bias;
+        // Set while activation waits for the biased readers to drain.
+        std::atomic<bool> m_read_bias_draining;
+        std::atomic<uint64_t> m_read_bias_inhibited_until; // steady_clock ticks.
+        std::chrono::steady_clock::time_point m_revocation_start; // Guarded by m_mutex.
+
+        const SchedulingPolicy m_scheduling;
+        const size_t m_max_bypasses;
+        SchedulingStats m_scheduling_stats; // Guarded by m_mutex.
+
+        const bool m_fast_path_enabled;
+        // Stays closed unless m_fast_path_enabled.
+        alignas(_cache_line_size) std::atomic<uint64_t> m_fast_state;
+    };
+
+
+    // BloomFilterLock over 8 slot keys, for key spaces which do not fit the 2^24 keys of the default Key.
+    template <typename InternalLockType=std::mutex, typename WaitPolicy=FutexWaitPolicy,
+              typename MergePolicy=FixedMergeLimits<>, typename Instrumentation=NoInstrumentation,
+              typename Tracking=ScanTracking>
+    using WideBloomFilterLock = BloomFilterLock<InternalLockType, WaitPolicy, MergePolicy, Instrumentation, 8, Tracking>;
+
+
+    template <typename LockType = BloomFilterLock<>, size_t NumShards = 8>
+    class ShardedBloomFilterLock
+    {
+    /* ShardedBloomFilterLock:
+     * Partitions the key space across NumShards independent BloomFilterLocks by the first slot (0-63) of
+     * each Key so that requests on independent key ranges never touch the same internal mutex or lock queue.
+     * Requests spanning several shards acquire the shards in ascending order, which keeps multi-shard requests
+     * deadlock free. The global locks sweep every shard in the same order. As with BloomFilterLock, a thread
+     * may only hold one request on a ShardedBloomFilterLock at a time and releases it with unlock().
+     */
+    public:
+        typedef typename LockType::KeyType KeyType;
+        typedef typename LockType::IntentionType IntentionType;
+
+        static_assert(NumShards > 0 && NumShards <= 64, "NumShards must be in the range 1-64");
+
+        ShardedBloomFilterLock() = default;
+        ShardedBloomFilterLock(const ShardedBloomFilterLock& rhs) = delete;
+        ShardedBloomFilterLock& operator = (const ShardedBloomFilterLock& rhs) = delete;
+
+        void global_read_lock();
+        void global_write_lock();
+
+        template <typename T>
+        void multilock(const T& reads, const T& writes);
+        void multilock(const IntentionType& l);
+        void read_lock(KeyType readKey);
+        void write_lock(KeyType writeKey);
+        void unlock();
+
+        static size_t shard_index(KeyType key)
+        {
+            return key.slot(0) % NumShards;
+        }
+
+    private:
+        // Bits of the slot 0 indicators routed to the given shard.
+        static constexpr size_t shard_mask(size_t shard)
+        {
+            size_t mask = 0;
+            for (size_t i = shard; i < 64; i += NumShards)
+                mask |= size_t(1) << i;
+            return mask;
+        }
+
+        void lock_shards(IntentionType (&intentions)[NumShards], uint64_t shards);
+        void set_held_shards(uint64_t shards);
+
+        // Shards held by the current thread on each ShardedBloomFilterLock it has locked.
+        static std::vector<std::pair<ShardedBloomFilterLock*, uint64_t>>& tl_held_shards()
+        {
+            static thread_local std::vector<std::pair<ShardedBloomFilterLock*, uint64_t>> held_shards;
+            return held_shards;
+        }
+
+        LockType m_shards[NumShards];
+    };
+
+
+    template <typename LockType = BloomFilterLock<_SpinLock, FutexWaitPolicy, FixedMergeLimits<>, NoInstrumentation,
+                                                  4, NoTracking>,
+              size_t NumNodes = 2>
+    class HierarchicalBloomFilterLock
+    {
+    /* HierarchicalBloomFilterLock:
+     * Puts a NUMA node level in front of one BloomFilterLock. Requests first merge into a batch of their node,
+     * under a lock private to the node, and only the leader of a batch, the thread that opened it, takes the
+     * combined request on the global lock. A node queues one batch at a time on the global lock, the next batch
+     * collects requests meanwhile and is closed by its leader once the batch ahead of it has been granted. The
+     * leader wakes the rest of its batch and the last member of a batch to release it releases the global lock,
+     * so the global lock and its records see one request per batch and node instead of one per thread.
+     * Global writes and requests which conflict with the open batch of the node take the global lock directly.
+     * Threads stay with the node they first locked on, a thread that migrates costs locality but not correctness.
+     * The global lock is released by whichever thread finishes a batch, so LockType must use NoTracking.
+     * As with BloomFilterLock, a thread may only hold one request at a time and releases it with unlock().
+     */
+    public:
+        typedef typename LockType::KeyType KeyType;
+        typedef typename LockType::IntentionType IntentionType;
+
+        static_assert(NumNodes > 0, "NumNodes must be at least 1");
+
+        HierarchicalBloomFilterLock() = default;
+        HierarchicalBloomFilterLock(const HierarchicalBloomFilterLock& rhs) = delete;
+        HierarchicalBloomFilterLock& operator = (const HierarchicalBloomFilterLock& rhs) = delete;
+        ~HierarchicalBloomFilterLock();
+
+        void global_read_lock();
+        void global_write_lock();
+
+        template <typename T>
+        void multilock(const T& reads, const T& writes);
+        void multilock(const IntentionType& l);
+        void read_lock(KeyType readKey);
+        void write_lock(KeyType writeKey);
+        void unlock();
+
+        // Node of the calling thread, as reported by getcpu when it first locks.
+        static size_t current_node();
+
+    private:
+        struct _Batch
+        {
+            _LockRecordBase::RecordType m_type;
+            IntentionType m_lock_intention;
+            // Members which have not released the batch yet.
+            std::atomic<size_t> m_num_locking;
+            _FutexWrapper m_futex;
+        };
+
+        struct alignas(_cache_line_size) _Node
+        {
+            std::mutex m_mutex;
+            std::condition_variable m_granted;
+            // Batch collecting requests, its leader has not queued it yet.
+            _Batch* m_open = nullptr;
+            // Whether a batch of the node is queued on the global lock and not yet granted.
+            bool m_queued = false;
+            std::vector<_Batch*> m_free_batches;
+        };
+
+        void lock_request(_LockRecordBase::RecordType type, const IntentionType& l);
+        void lock_global(_LockRecordBase::RecordType type, const IntentionType& l);
+        void set_held_batch(_Batch* batch);
+
+        // Batch held by the current thread on each HierarchicalBloomFilterLock it has locked, nullptr for a
+        // request taken directly on the global lock.
+        static std::vector<std::pair<HierarchicalBloomFilterLock*, _Batch*>>& tl_held_batches()
+        {
+            static thread_local std::vector<std::pair<HierarchicalBloomFilterLock*, _Batch*>> held_batches;
+            return held_batches;
+        }
+
+        LockType m_global;
+        _Node m_nodes[NumNodes];
+    };
+
+
+    // Serializes the queueing passes of all LockSets.
+    inline std::mutex& _lock_set_mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+
+    template <typename LockType = BloomFilterLock<>>
+    class LockSet
+    {
+    /* LockSet:
+     * Holds requests on several BloomFilterLock instances as one, e.g. one lock per table. lock() queues
+     * every request at the back of its instance and only then waits, so the waits on the instances overlap.
+     * The queueing passes of all LockSets are serialized and visit the instances in ascending address order,
+     * so on every instance two LockSets share the earlier one is queued ahead of the later one, which keeps
+     * LockSets deadlock free among each other. For that their requests always get records of their own
+     * instead of being merged into records further ahead, later requests can still merge into them.
+     * An instance may only appear once in a LockSet and the thread may not hold another request on it.
+     * unlock() releases every instance.
+     */
+    public:
+        typedef typename LockType::IntentionType IntentionType;
+        typedef std::pair<LockType*, IntentionType> Entry;
+
+        LockSet() = default;
+        LockSet(std::initializer_list<Entry> entries):
+            m_entries(entries)
+        {
+        }
+
+        void add(LockType& lock, const IntentionType& l)
+        {
+            m_entries.emplace_back(&lock, l);
+        }
+
+        void lock();
+        void unlock();
+
+    private:
+        std::vector<Entry> m_entries;
+    };
+
+
+    // Acquires entries as a LockSet which releases them all with unlock(), e.g.
+    // auto tables = multi_instance_lock<Lock>({{&table_a, intention_a}, {&table_b, intention_b}});
+    template <typename LockType>
+    LockSet<LockType> multi_instance_lock(std::initializer_list<typename LockSet<LockType>::Entry> entries)
+    {
+        LockSet<LockType> lock_set(entries);
+        lock_set.lock();
+        return lock_set;
+    }
+
+
+    template <size_t KeySlots = 4, size_t NumRecords = 64, size_t MaxRequests = 16>
+    class SharedBloomFilterLock
+    {
+    /* SharedBloomFilterLock:
+     * Process shared variant of BloomFilterLock for a lock placed in shared memory, e.g. a MAP_SHARED mapping
+     * which several processes may map at different addresses. The record pool, the lock queue and the active
+     * record are all part of the object and link records by index instead of by pointer, the internal lock is
+     * a _SpinLock on a lock-free atomic and records are waited on with process shared futexes. create() constructs
+     * the lock in a region of sizeof(SharedBloomFilterLock) bytes aligned to _cache_line_size, attach() returns the
+     * lock another process has created in a region.
+     * Requests merge like those of BloomFilterLock into the front and back records of the queue and, while the
+     * queue is empty, into the active record, each record holding up to MaxRequests requests. A request registers
+     * the pid of its process in its record. Waiters wake every recovery_interval to release the requests of
+     * processes that have exited, so a process dying while it holds or waits for the lock does not block it for
+     * good. A process dying inside the short internal critical sections is not recovered, nor is one that has
+     * exited but is not reaped yet, or whose pid has been reused.
+     * A thread may hold one request per lock, unlock() releases it.
+     */
+    public:
+        typedef BasicKey<KeySlots> KeyType;
+        typedef BasicLockIntention<KeySlots> IntentionType;
+        static constexpr std::chrono::milliseconds recovery_interval{100};
+
+        SharedBloomFilterLock();
+        SharedBloomFilterLock(const SharedBloomFilterLock&) = delete;
+        SharedBloomFilterLock& operator=(const SharedBloomFilterLock&) = delete;
+
+        static SharedBloomFilterLock* create(void* region);
+        // Returns nullptr if no lock has been created in region.
+        static SharedBloomFilterLock* attach(void* region);
+
+        void global_read_lock();
+        void global_write_lock();
+
+        template <typename T>
+        void multilock(const T& reads, const T& writes);
+        void multilock(const IntentionType& l);
+        void read_lock(KeyType readKey);
+        void write_lock(KeyType writeKey);
+        void unlock();
+
+        // Releases the requests of processes that have exited, returns the number released.
+        size_t recover();
+
+    private:
+        typedef _LockRecordBase::RecordType RecordType;
+        static constexpr uint64_t _magic = 0x626c6f6f6d736872;
+        static_assert(std::atomic<bool>::is_always_lock_free && std::atomic<int32_t>::is_always_lock_free,
+                      "process shared locks need address free atomics");
+
+        struct _Record
+        {
+            _BasicFutexWrapper<true> m_futex;
+            RecordType m_type;
+            // Index of the next record in the queue or the free list, 0 for none.
+            uint32_t m_next;
+            uint32_t m_num_requests;
+            // Process of each request, 0 for a free slot.
+            pid_t m_pids[MaxRequests];
+            IntentionType m_lock_intention;
+        };
+
+        struct _HeldRequest
+        {
+            const SharedBloomFilterLock* lock;
+            uint32_t record;
+            uint32_t slot;
+        };
+
+        void lock_request(RecordType type, const IntentionType& l);
+        bool merge_into(uint32_t r, RecordType type, const IntentionType& l);
+        uint32_t add_request(uint32_t r, pid_t pid);
+        uint32_t new_record(RecordType type, const IntentionType& l);
+        void free_record(uint32_t r);
+        void wait_on(uint32_t r);
+        void activate_queue_front();
+        void complete_active_record();
+        size_t release_exited(uint32_t r, pid_t self);
+
+        static bool _process_exited(pid_t pid)
+        {
+            return kill(pid, 0) == -1 && errno == ESRCH;
+        }
+
+        _Record& record(uint32_t r)
+        {
+            return m_records[r - 1];
+        }
+
+        static std::vector<_HeldRequest>& tl_held_requests()
+        {
+            static thread_local std::vector<_HeldRequest> held_requests;
+            return held_requests;
+        }
+
+        std::atomic<uint64_t> m_magic;
+        _SpinLock m_lock;
+        // Record indexes start at 1, 0 stands for none.
+        uint32_t m_active;
+        uint32_t m_queue_front;
+        uint32_t m_queue_back;
+        uint32_t m_free_records;
+        _Record m_records[NumRecords];
     };
 }
 
@@ -9,62 +9,131 @@
 namespace bloomfilter_lock
 {
     
-    bool _LockRecord::merge_lock_request(const LockIntention& l)
+    template <size_t S>
+    _LockRecordBase::MergeResult _LockRecord<S>::merge_lock_request(const IntentionType& l, size_t max_requests,
+                                                                    size_t max_writes, size_t exact_keys)
     {
         // a count of 0 is guaranteed accurate.
-        if (m_record_type == ReadOnly)
-            return l.m_min_writes == 0;
+        if (record_type() == ReadOnly)
+            return l.m_min_writes == 0 ? Merged : RejectedReadOnly;
     
-        if (m_record_type == None)
+        if (record_type() == None)
         {
-            m_record_type = ReadWrite;
+            set_record_type(ReadWrite);
             m_num_requests = 1;
             m_lock_intention = l;
-            return true;
+            _count(l);
+            return Merged;
         }
     
-        if (m_record_type == Exclusive)
-            return false;
+        if (record_type() == Exclusive)
+            return RejectedExclusive;
     
-        if (l.m_min_writes > 8)
-            return false;
+        if (l.m_min_writes > max_writes)
+            return RejectedWriteLimit;
         
-        if (not m_lock_intention.merge(l))
-            return false;
+        auto check = IntentionType::NoConflict;
+        if (not m_lock_intention.merge(l, exact_keys, &check))
+            return check == IntentionType::KeyConflict ? RejectedKeyConflict : RejectedConflict;
         
+        _count(l);
         m_num_requests += 1;
-        if (m_num_requests > 8)
-            m_record_type = Exclusive;
-        return true;
+        if (m_num_requests > max_requests)
+            set_record_type(Exclusive);
+        return check == IntentionType::FalseConflict ? MergedOnExactKeys : Merged;
+    }
+    
+
+    template <size_t S>
+    template <typename MergeKey>
+    _LockRecordBase::MergeResult _LockRecord<S>::_merge_key_request(KeyType id, size_t num_writes, size_t max_requests,
+                                                                    size_t max_writes, MergeKey merge_key)
+    {
+        // merge_lock_request for a single key intention, merge_key adds the key to the record intention.
+        if (record_type() == ReadOnly)
+            return num_writes == 0 ? Merged : RejectedReadOnly;
+    
+        if (record_type() == None)
+        {
+            set_record_type(ReadWrite);
+            m_num_requests = 1;
+            m_lock_intention.clear();
+            merge_key(m_lock_intention, id, nullptr);
+            _count_key(id, num_writes);
+            return Merged;
+        }
+    
+        if (record_type() == Exclusive)
+            return RejectedExclusive;
+
+        if (num_writes > max_writes)
+            return RejectedWriteLimit;
+
+        auto check = IntentionType::NoConflict;
+        if (not merge_key(m_lock_intention, id, &check))
+            return check == IntentionType::KeyConflict ? RejectedKeyConflict : RejectedConflict;
+        
+        _count_key(id, num_writes);
+        m_num_requests += 1;
+        if (m_num_requests > max_requests)
+            set_record_type(Exclusive);
+        return check == IntentionType::FalseConflict ? MergedOnExactKeys : Merged;
     }
     
 
-    bool _LockRecord::merge_read_lock_request(Key id)
+    template <size_t S>
+    _LockRecordBase::MergeResult _LockRecord<S>::merge_read_lock_request(KeyType id, size_t max_requests,
+                                                                         size_t max_writes, size_t exact_keys)
     {
-        return merge_lock_request(LockIntention({id}, {Key(0)}));
+        return _merge_key_request(id, 0, max_requests, max_writes,
+                                  [exact_keys](IntentionType& l, KeyType key, typename IntentionType::KeyCheck* check)
+                                  {return l.merge_read_key(key, exact_keys, check);});
     }
 
     
-    bool _LockRecord::merge_write_lock_request(Key id)
+    template <size_t S>
+    _LockRecordBase::MergeResult _LockRecord<S>::merge_write_lock_request(KeyType id, size_t max_requests,
+                                                                          size_t max_writes, size_t exact_keys)
     {
-        return merge_lock_request(LockIntention({id}, {id}));
+        return _merge_key_request(id, id.m_value != 0, max_requests, max_writes,
+                                  [exact_keys](IntentionType& l, KeyType key, typename IntentionType::KeyCheck* check)
+                                  {return l.merge_write_key(key, exact_keys, check);});
     }
 
 
-    template <typename T>
-    BloomFilterLock<T>::BloomFilterLock():
-        m_active_lock_record(nullptr)
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    BloomFilterLock<T, W, M, I, S, R>::BloomFilterLock(const BloomFilterLockOptions& options):
+        m_active_lock_record(nullptr),
+        m_lock_queue(new Record),
+        m_arena_capacity(0),
+        m_record_waiters(0),
+        m_record_overflow(options.record_overflow),
+        m_closing(false),
+        m_merge_window(std::max<size_t>(options.merge_window, 1)),
+        m_merge_window_policy(options.merge_window_policy),
+        m_max_active_joins(options.max_active_joins),
+        m_active_joins(0),
+        m_merges_at_depth(m_merge_window),
+        m_unmerged(0),
+        m_read_bias_enabled(options.read_bias),
+        m_read_bias(options.read_bias),
+        m_read_bias_draining(false),
+        m_read_bias_inhibited_until(0),
+        m_scheduling(options.scheduling),
+        m_max_bypasses(options.max_bypasses),
+        m_scheduling_stats(),
+        m_fast_path_enabled(options.fast_path && not options.read_bias),
+        m_fast_state(m_fast_path_enabled ? 0 : _FastPath::Closed)
     {
-        for (auto i = 0; i < 7; i++)
-        {
-            m_record_pool.push_back(new _LockRecord);
-        }
-        m_lock_queue.push(new _LockRecord);
+        // An idle lock keeps one record as its queue front and one back for the spare, so waiting for a
+        // record needs a third.
+        reserve_records(options.record_overflow == HeapOverflow ? options.arena_capacity :
+                        std::max<size_t>(options.arena_capacity, 3));
     }
 
 
-    template <typename T>
-    BloomFilterLock<T>::~BloomFilterLock()
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    BloomFilterLock<T, W, M, I, S, R>::~BloomFilterLock()
     {
         std::unique_lock<T> guard(m_mutex);
         if (m_closing)
@@ -75,186 +144,2020 @@ namespace bloomfilter_lock
 
         m_closing = true;
 
-        while (!m_lock_queue.empty())
+        Record *r = m_lock_queue.front();
+        while (r)
         {
-            _LockRecord *r = m_lock_queue.front();
+            auto next = m_lock_queue.next(r);
             r->close();
-            m_lock_queue.pop();
             r->clear();
-            delete r;
+            delete_lock_record(r);
+            r = next;
         }
 
-        auto lock_record = m_active_lock_record;
+        auto lock_record = m_active_lock_record.load();
         if (lock_record)
         {
             m_active_lock_record = nullptr;
             lock_record->close();            
-            delete lock_record;
+            for (auto r = lock_record->m_absorbed; r; r = lock_record->m_absorbed)
+            {
+                lock_record->m_absorbed = r->m_absorbed;
+                delete_lock_record(r);
+            }
+            delete_lock_record(lock_record);
         }
+        // The pooled records all belong to the arena.
+    }
 
-        for (auto r : m_record_pool)
-            delete r;
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    void BloomFilterLock<T, W, M, I, S, R>::reserve_records(size_t capacity)
+    {
+        std::unique_lock<_SpinLock> guard(m_pool_lock);
+        auto current = m_arena_capacity.load(std::memory_order_relaxed);
+        if (capacity <= current)
+            return;
+
+        std::unique_ptr<Record[]> block(new Record[capacity - current]);
+        // The pool only ever holds arena records so freeing a record never reallocates it.
+        m_record_pool.reserve(capacity);
+        for (size_t i = 0; i < capacity - current; ++i)
+        {
+            block[i].m_in_arena = true;
+            m_record_pool.push_back(&block[i]);
+        }
+        m_arena.push_back(std::move(block));
+        m_arena_capacity.store(capacity, std::memory_order_relaxed);
+        bool waiters = m_record_waiters;
+        guard.unlock();
+        if (waiters)
+            m_record_freed.notify_all();
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    size_t BloomFilterLock<T, W, M, I, S, R>::record_capacity() const
+    {
+        return m_arena_capacity.load(std::memory_order_relaxed);
     }
 
     
-    template <typename T>
-    _LockRecord* BloomFilterLock<T>::allocate_lock_record()
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    _LockRecord<S>* BloomFilterLock<T, W, M, I, S, R>::allocate_lock_record()
     {
-        // m_mutex must be held when calling this.
-        _LockRecord *result = 0;
+        std::unique_lock<_SpinLock> guard(m_pool_lock);
+        Record *result = 0;
         if (m_record_pool.size())
         {
             result = m_record_pool.back();
             m_record_pool.pop_back();
+            guard.unlock();
+            m_instrumentation.record_allocated(true);
         }
         else
         {
-            result = new _LockRecord;
+            guard.unlock();
+            result = new Record;
+            m_instrumentation.record_allocated(false);
         }
         return result;
     }
 
 
-    template <typename T>
-    void BloomFilterLock<T>::global_read_lock()
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    _LockRecord<S>* BloomFilterLock<T, W, M, I, S, R>::allocate_lock_record(Record*& reserved)
     {
-        
-        tl_existing_locks.track(this);        
-        std::unique_lock<T> lock(m_mutex);
-        
-        // Attempt to merge in a read request into the head of the lock queue.
-        if (m_lock_queue.front()->global_read_request())
+        if (not reserved)
+            return allocate_lock_record();
+
+        auto result = reserved;
+        reserved = nullptr;
+        return result;
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    _LockRecord<S>* BloomFilterLock<T, W, M, I, S, R>::wait_for_record(std::chrono::steady_clock::time_point deadline)
+    {
+        std::unique_lock<_SpinLock> guard(m_pool_lock);
+        // The last record is kept back for the spare of the lock queue.
+        while (m_record_pool.size() <= 1)
+        {
+            ++m_record_waiters;
+            if (deadline == std::chrono::steady_clock::time_point::max())
+                m_record_freed.wait(guard);
+            else if (m_record_freed.wait_until(guard, deadline) == std::cv_status::timeout &&
+                     m_record_pool.size() <= 1)
+            {
+                --m_record_waiters;
+                return nullptr;
+            }
+            --m_record_waiters;
+        }
+
+        auto result = m_record_pool.back();
+        m_record_pool.pop_back();
+        guard.unlock();
+        m_instrumentation.record_allocated(true);
+        return result;
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    bool BloomFilterLock<T, W, M, I, S, R>::records_exhausted()
+    {
+        std::unique_lock<_SpinLock> guard(m_pool_lock);
+        return m_record_pool.empty();
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    void BloomFilterLock<T, W, M, I, S, R>::free_lock_record(Record* r)
+    {
+        // r must have been cleared. Heap records are freed, the pool stays within the arena.
+        if (not r->m_in_arena)
         {
-            wait_at_queue_front(lock);
+            delete r;
             return;
         }
 
-        if (m_lock_queue.size() > 1)
+        std::unique_lock<_SpinLock> guard(m_pool_lock);
+        m_record_pool.push_back(r);
+        bool waiters = m_record_waiters;
+        guard.unlock();
+        if (waiters)
+            m_record_freed.notify_one();
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    void BloomFilterLock<T, W, M, I, S, R>::delete_lock_record(Record* r)
+    {
+        // Arena records are freed with the arena.
+        if (not r->m_in_arena)
+            delete r;
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    _AsyncWaiter* BloomFilterLock<T, W, M, I, S, R>::activate_queue_front(Record*& spare)
+    {
+        // m_mutex must be held and no record may be active. spare, a cleared record or nullptr, replaces
+        // the front if it is the only record in the queue. A spare left over is for the caller to free once
+        // m_mutex is released. Returns the asynchronous waiters and the futex wake of the activated record,
+        // to be resumed likewise.
+        _AsyncWaiter* activated = nullptr;
+        while (1)
         {
-            if (m_lock_queue.back()->global_read_request())
+            auto front = m_lock_queue.front();
+            auto next = m_lock_queue.next(front);
+            if (front->record_type() == Record::None)
             {
-                wait_at_queue_back(lock);
-                return;
+                // Requests enqueued without the mutex can leave an empty record ahead of them.
+                if (not next)
+                {
+                    // The queue is idle.
+                    if (m_fast_path_enabled)
+                        _FastPath::open(m_fast_state);
+                    break;
+                }
+                m_lock_queue.pop(nullptr);
+                free_lock_record(front);
+                continue;
+            }
+
+            if (m_scheduling != Fifo && next)
+            {
+                Record* prev;
+                auto r = schedule(front, prev);
+                if (r != front)
+                {
+                    if (m_read_bias_enabled && r->writes() && not revoke_read_bias())
+                        break;
+                    if (not close_fast_path())
+                        break;
+                    for (auto b = front; b != r; b = m_lock_queue.next(b))
+                    {
+                        ++b->m_bypassed;
+                        m_scheduling_stats.max_bypassed = std::max<size_t>(m_scheduling_stats.max_bypassed, b->m_bypassed);
+                    }
+                    m_lock_queue.remove(prev, r);
+                    m_active_lock_record.store(r, std::memory_order_seq_cst);
+                    if constexpr (I::enabled)
+                        r->m_activation_time = m_instrumentation.now();
+                    ++m_scheduling_stats.activations;
+                    ++m_scheduling_stats.promotions;
+                    m_active_joins = 0;
+                    trace_activate(r);
+                    activated = r->activate(_wake_fanout<W>::value);
+                    break;
+                }
+            }
+
+            if (not next && not spare)
+                spare = allocate_lock_record();
+
+            if constexpr (I::enabled)
+            {
+                size_t depth = 0;
+                for (auto r = front; r; r = m_lock_queue.next(r))
+                    ++depth;
+                m_instrumentation.queue_depth(depth);
+            }
+
+            // Nobody would release a record whose requests have all timed out.
+            bool abandoned = front->abandoned();
+            // Biased readers hold the lock outside of the queue, a write waits for them to drain.
+            if (m_read_bias_enabled && not abandoned && front->writes() && not revoke_read_bias())
+                break;
+            // Fast path holders hold the lock outside of the queue, the last of them activates it.
+            if (not abandoned && not close_fast_path())
+                break;
+            if (not abandoned)
+                m_active_lock_record.store(front, std::memory_order_seq_cst);
+            if (m_lock_queue.pop(spare))
+                spare = nullptr;
+            if (abandoned)
+            {
+                front->clear();
+                free_lock_record(front);
+                continue;
             }
+            if constexpr (I::enabled)
+                front->m_activation_time = m_instrumentation.now();
+            ++m_scheduling_stats.activations;
+            m_active_joins = 0;
+            trace_activate(front);
+            activated = front->activate(_wake_fanout<W>::value);
+            break;
         }
-        
-        _LockRecord *r = allocate_lock_record();
-        wait_at_queue_back(lock, r);
+        return activated;
     }
 
 
-    template <typename T>
-    void BloomFilterLock<T>::global_write_lock()
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    _LockRecord<S>* BloomFilterLock<T, W, M, I, S, R>::schedule(Record* front, Record*& prev)
+    {
+        auto rank = [this](Record* r) -> int
+        {
+            switch (m_scheduling)
+            {
+                case WriterPreferring:
+                    return r->writes();
+                case ReaderPreferring:
+                    return not r->writes();
+                case PriorityLanes:
+                    return r->m_priority;
+                default:
+                    return 0;
+            }
+        };
+
+        // A promotion passes over every record ahead of it, so no record has been passed over more often than
+        // the front.
+        if (front->m_bypassed >= m_max_bypasses)
+        {
+            ++m_scheduling_stats.bounded_activations;
+            return front;
+        }
+
+        // A record is only promoted over records it is compatible with, so that conflicting requests are
+        // still granted in queue order, see Ordered.
+        auto compatible_ahead = [this, front](Record* r)
+        {
+            for (auto b = front; b != r; b = m_lock_queue.next(b))
+            {
+                if (not b->abandoned() && not r->compatible_with(b))
+                    return false;
+            }
+            return true;
+        };
+
+        // Only the first records are considered so that activation stays cheap behind a long queue.
+        constexpr size_t window = 64;
+        Record* next = front;
+        Record* next_prev = nullptr;
+        Record* before = nullptr;
+        size_t depth = 0;
+        for (auto r = front; r && depth < window; before = r, r = m_lock_queue.next(r), ++depth)
+        {
+            // Abandoned records are cleaned up once they reach the front.
+            if (r != front && rank(r) > rank(next) && not r->abandoned() && compatible_ahead(r))
+            {
+                next = r;
+                next_prev = before;
+            }
+            if (r->m_barrier)
+                break;
+        }
+
+        if (next == front)
+            return front;
+
+        // The records passed over are counted once next is activated, see activate_queue_front.
+        prev = next_prev;
+        return next;
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    void BloomFilterLock<T, W, M, I, S, R>::global_read_lock(uint8_t priority)
     {
-        tl_existing_locks.track(this);
+        
+        m_tracking.track(this);        
+        if (m_read_bias_enabled && try_biased_read_lock())
+            return;
+        if (try_fast_lock(_FastPath::AllAccesses))
+            return;
+
+        auto start = m_instrumentation.now();
+        Record* reserved = nullptr;
+        if (m_record_overflow == BlockOnOverflow)
+            reserved = wait_for_record(std::chrono::steady_clock::time_point::max());
         std::unique_lock<T> lock(m_mutex);
+        
+        Record *r;
+        // The back of the queue can move under requests enqueued without m_mutex so it is only read once.
+        auto queue_back = m_lock_queue.back();
+        // Attempt to merge in a read request into the head of the lock queue.
+        if (m_lock_queue.front()->global_read_request())
+        {
+            m_lock_queue.front()->raise_priority(priority);
+            r = latch_at_queue_front(lock);
+        }
+        else if (queue_back != m_lock_queue.front() && queue_back->global_read_request())
+        {
+            queue_back->raise_priority(priority);
+            r = latch_in_queue(lock, queue_back);
+        }
+        else
+        {
+            r = allocate_lock_record(reserved);
+            r->global_read_request();
+            r->raise_priority(priority);
+            r = latch_at_queue_back(lock, r);
+        }
+        if (reserved)
+            free_lock_record(reserved);
+        wait_on(r, start);
+        if (m_read_bias_enabled)
+            restore_read_bias();
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    void BloomFilterLock<T, W, M, I, S, R>::global_write_lock(uint8_t priority)
+    {
+        m_tracking.track(this);
+        if (try_fast_lock(_FastPath::AllAccesses | _FastPath::AllWrites))
+            return;
+        auto start = m_instrumentation.now();
+        Record* reserved = nullptr;
+        if (m_record_overflow == BlockOnOverflow)
+            reserved = wait_for_record(std::chrono::steady_clock::time_point::max());
+        if (m_lock_queue.front()->record_type() != Record::None)
+        {
+            // The front can not take a global write so there is no need to take m_mutex to enqueue.
+            Record *r = allocate_lock_record(reserved);
+            r->global_write_request();
+            r->raise_priority(priority);
+            wait_on(latch_at_queue_back(r), start);
+            hold_request(IntentionType(), r, true);
+            return;
+        }
 
+        std::unique_lock<T> lock(m_mutex);
         if (m_lock_queue.front()->global_write_request())
         {
-            wait_at_queue_front(lock);
+            if (reserved)
+                free_lock_record(reserved);
+            m_lock_queue.front()->raise_priority(priority);
+            auto r = latch_at_queue_front(lock);
+            wait_on(r, start);
+            hold_request(IntentionType(), r, true);
             return;
         }
 
-        _LockRecord *r = allocate_lock_record();
+        Record *r = allocate_lock_record(reserved);
         r->global_write_request();
-        wait_at_queue_back(lock, r);
+        r->raise_priority(priority);
+        wait_on(latch_at_queue_back(lock, r), start);
+        hold_request(IntentionType(), r, true);
     }
 
 
-    template <typename LockType>
+    template <typename LockType, typename W, typename M, typename I, size_t S, typename R>
     template <typename T>
-    void BloomFilterLock<LockType>::multilock(const T& reads, const T& writes)
+    void BloomFilterLock<LockType, W, M, I, S, R>::multilock(const T& reads, const T& writes)
     {
-        multilock(LockIntention(reads, writes));   
+        multilock(IntentionType(reads, writes));   
     }
 
     
-    template <typename LockType>
-    void BloomFilterLock<LockType>::multilock(const LockIntention& l)
+    template <typename LockType, typename W, typename M, typename I, size_t S, typename R>
+    void BloomFilterLock<LockType, W, M, I, S, R>::multilock(const IntentionType& l, uint8_t priority)
     {
-        tl_existing_locks.track(this);
-        std::unique_lock<LockType> lock(m_mutex);
-        if (m_lock_queue.front()->merge_lock_request(l))
-        {
-            wait_at_queue_front(lock);
-            return;
-        }
-
-        _LockRecord *r = allocate_lock_record();
-        r->merge_lock_request(l);
-        wait_at_queue_back(lock, r);    
+        lock_request(_IntentionRequest<S>{l, priority});
     }
     
     
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    void BloomFilterLock<T, W, M, I, S, R>::read_lock(KeyType resource_id)
+    {
+        lock_request(_ReadKeyRequest<S>{resource_id});
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    void BloomFilterLock<T, W, M, I, S, R>::write_lock(KeyType resource_id)
+    {
+        lock_request(_WriteKeyRequest<S>{resource_id});
+    }
+
+
+    template <typename LockType, typename W, typename M, typename I, size_t S, typename R>
     template <typename T>
-    void BloomFilterLock<T>::read_lock(Key resource_id)
+    bool BloomFilterLock<LockType, W, M, I, S, R>::try_multilock(const T& reads, const T& writes)
+    {
+        return try_multilock(IntentionType(reads, writes));
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    bool BloomFilterLock<T, W, M, I, S, R>::try_multilock(const IntentionType& l)
+    {
+        return try_lock_request(_IntentionRequest<S>{l});
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    bool BloomFilterLock<T, W, M, I, S, R>::try_read_lock(KeyType resource_id)
+    {
+        return try_lock_request(_ReadKeyRequest<S>{resource_id});
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    bool BloomFilterLock<T, W, M, I, S, R>::try_write_lock(KeyType resource_id)
+    {
+        return try_lock_request(_WriteKeyRequest<S>{resource_id});
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Rep, typename Period>
+    bool BloomFilterLock<T, W, M, I, S, R>::multilock_for(const IntentionType& l,
+                                                 const std::chrono::duration<Rep, Period>& timeout)
     {
-        tl_existing_locks.track(this);
+        return lock_request_until(_IntentionRequest<S>{l}, _steady_deadline(timeout));
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Clock, typename Duration>
+    bool BloomFilterLock<T, W, M, I, S, R>::multilock_until(const IntentionType& l,
+                                                   const std::chrono::time_point<Clock, Duration>& deadline)
+    {
+        return lock_request_until(_IntentionRequest<S>{l}, _steady_deadline(deadline));
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Rep, typename Period>
+    bool BloomFilterLock<T, W, M, I, S, R>::read_lock_for(KeyType resource_id, const std::chrono::duration<Rep, Period>& timeout)
+    {
+        return lock_request_until(_ReadKeyRequest<S>{resource_id}, _steady_deadline(timeout));
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Clock, typename Duration>
+    bool BloomFilterLock<T, W, M, I, S, R>::read_lock_until(KeyType resource_id,
+                                                   const std::chrono::time_point<Clock, Duration>& deadline)
+    {
+        return lock_request_until(_ReadKeyRequest<S>{resource_id}, _steady_deadline(deadline));
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Rep, typename Period>
+    bool BloomFilterLock<T, W, M, I, S, R>::write_lock_for(KeyType resource_id, const std::chrono::duration<Rep, Period>& timeout)
+    {
+        return lock_request_until(_WriteKeyRequest<S>{resource_id}, _steady_deadline(timeout));
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Clock, typename Duration>
+    bool BloomFilterLock<T, W, M, I, S, R>::write_lock_until(KeyType resource_id,
+                                                    const std::chrono::time_point<Clock, Duration>& deadline)
+    {
+        return lock_request_until(_WriteKeyRequest<S>{resource_id}, _steady_deadline(deadline));
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Request>
+    void BloomFilterLock<T, W, M, I, S, R>::lock_request(const Request& request)
+    {
+        m_tracking.track(this);
+        if (try_fast_lock(request.fast_summary()))
+            return;
+        auto start = m_instrumentation.now();
+        Record* reserved = nullptr;
+        if (m_record_overflow == BlockOnOverflow)
+            reserved = wait_for_record(std::chrono::steady_clock::time_point::max());
+        auto r = enqueue_request(request, reserved);
+        wait_on(r, start);
+        hold_request(request, r);
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Request>
+    bool BloomFilterLock<T, W, M, I, S, R>::try_lock_request(const Request& request)
+    {
+        m_tracking.track(this);
+        if (try_fast_lock(request.fast_summary()))
+            return true;
+        // Activating the queue front can take the last record as the spare, which is all a try_ request needs.
+        if (m_record_overflow != HeapOverflow && records_exhausted())
+        {
+            m_tracking.untrack(this);
+            return false;
+        }
 
         std::unique_lock<T> lock(m_mutex);
-        if (m_lock_queue.front()->merge_read_lock_request(resource_id))
+        // With no active record the queue front is activated as soon as it is latched, unless it writes
+        // and biased readers still hold the lock, or fast path holders do.
+        bool revoke = m_read_bias_enabled && (request.num_writes() || m_lock_queue.front()->writes());
+        if (not m_active_lock_record.load(std::memory_order_relaxed) && (not revoke || revoke_read_bias()) &&
+            close_fast_path() && merge_into(request, m_lock_queue.front()))
         {
-            wait_at_queue_front(lock);
-            return;
+            auto r = latch_at_queue_front(lock);
+            r->wait(m_wait_policy);
+            hold_request(request, r);
+            return true;
         }
-        
-        _LockRecord *r = allocate_lock_record();
-        r->merge_read_lock_request(resource_id);
-        wait_at_queue_back(lock, r);
+
+        if (auto r = join_active_record(request))
+        {
+            lock.unlock();
+            r->wait(m_wait_policy);
+            hold_request(request, r);
+            return true;
+        }
+
+        // A fast path closed above is reopened if the queue is idle, as the activation of an idle queue does,
+        // so that a failed try_ request does not keep later requests off it.
+        Record* front = m_lock_queue.front();
+        if (m_fast_path_enabled && not m_active_lock_record.load(std::memory_order_relaxed) &&
+            front->record_type() == Record::None && not m_lock_queue.next(front))
+            _FastPath::open(m_fast_state);
+        lock.unlock();
+        m_tracking.untrack(this);
+        return false;
     }
 
 
-    template <typename T>
-    void BloomFilterLock<T>::write_lock(Key resource_id)
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Request>
+    bool BloomFilterLock<T, W, M, I, S, R>::lock_request_until(const Request& request,
+                                                      std::chrono::steady_clock::time_point deadline)
     {
-        tl_existing_locks.track(this);
+        m_tracking.track(this);
+        if (try_fast_lock(request.fast_summary()))
+            return true;
+        Record* reserved = nullptr;
+        if (m_record_overflow == BlockOnOverflow && not (reserved = wait_for_record(deadline)))
+        {
+            m_tracking.untrack(this);
+            return false;
+        }
 
-        std::unique_lock<T> lock(m_mutex);
-        if (m_lock_queue.front()->merge_write_lock_request(resource_id))
+        auto r = enqueue_request(request, reserved);
+        if (wait_until(r, deadline))
         {
-            wait_at_queue_front(lock);
-            return;
+            hold_request(request, r);
+            return true;
         }
-        _LockRecord *r = allocate_lock_record();
-        r->merge_write_lock_request(resource_id);
-        wait_at_queue_back(lock, r);
+
+        m_tracking.untrack(this);
+        return false;
     }
 
 
-    template <typename T>
-    void BloomFilterLock<T>::unlock()
-    {        
-        tl_existing_locks.untrack(this);
-        
-        // valgrind seems to fail to establish happens-before on the
-        // update to m_active_lock_record in a previous unlock op w/o
-        // this spinlock. From my understanding of happens-before, it should
-        // not strictly be necessary as happens-before for this is established
-        // by the spinlock held in the activate call itself.        
-        auto released_lock_record = m_active_lock_record;        
-        
-        if (released_lock_record->release())
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Request>
+    _LockRecord<S>* BloomFilterLock<T, W, M, I, S, R>::enqueue_request(const Request& request, Record* reserved)
+    {
+        if (m_merge_window == 1 && m_merge_window_policy == FirstFit && 
+            m_lock_queue.front()->closed_to(request.num_writes()))
         {
-            // This thread is responsible for clearing the lock record and activating the next one.                 
-            released_lock_record->clear();                                        
-            std::unique_lock<T> guard(m_mutex);
-            m_active_lock_record = 0;
-            if (m_lock_queue.front()->record_type() != _LockRecord::None)
-            {
-                auto lock_record = m_lock_queue.front();
-                m_lock_queue.pop();      
-                m_active_lock_record = lock_record;                                    
-                lock_record->activate();
-            }
+            // The front can not take the request so there is no need to take m_mutex to enqueue.
+            Record *r = allocate_lock_record(reserved);
+            request.merge_into(r, m_merge_policy);
+            r->raise_priority(request.m_priority);
+            m_unmerged.fetch_add(1, std::memory_order_relaxed);
+            return latch_at_queue_back(r);
+        }
 
-            if (m_lock_queue.empty())
-                m_lock_queue.push(released_lock_record);           
-            else
-                m_record_pool.push_back(released_lock_record);
+        std::unique_lock<T> lock(m_mutex);
+        auto r = join_active_record(request);
+        if (not r && (r = merge_in_window(request)))
+        {
+            r->raise_priority(request.m_priority);
+            r = latch_in_queue(lock, r);
         }
+        if (r)
+        {
+            if (reserved)
+                free_lock_record(reserved);
+            return r;
+        }
+
+        r = allocate_lock_record(reserved);
+        request.merge_into(r, m_merge_policy);
+        r->raise_priority(request.m_priority);
+        m_unmerged.fetch_add(1, std::memory_order_relaxed);
+        return latch_at_queue_back(lock, r);
     }
 
-    
-    template <typename T>
-    thread_local _TLResourceTracker<T> BloomFilterLock<T>::tl_existing_locks;
-}
\ No newline at end of file
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    _LockRecord<S>* BloomFilterLock<T, W, M, I, S, R>::push_request(const IntentionType& l)
+    {
+        Record *r = allocate_lock_record();
+        _IntentionRequest<S>{l}.merge_into(r, m_merge_policy);
+        m_unmerged.fetch_add(1, std::memory_order_relaxed);
+        // Passing over the record could reorder two LockSets differently on two instances.
+        r->m_barrier = true;
+        r->_latch();
+        trace_enqueue(r);
+        m_lock_queue.push(r);
+        return r;
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    bool BloomFilterLock<T, W, M, I, S, R>::wait_until(Record* r, std::chrono::steady_clock::time_point deadline)
+    {
+        if (r->wait_until(m_wait_policy, deadline))
+            return true;
+
+        // Withdrawing under m_mutex keeps the waiter count stable for merges and activation, which
+        // skips a record once all of its waiters have withdrawn.
+        std::unique_lock<T> guard(m_mutex);
+        return r->withdraw();
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Callback>
+    void BloomFilterLock<T, W, M, I, S, R>::async_multilock(const IntentionType& l, Callback callback)
+    {
+        async_lock_request(_IntentionRequest<S>{l}, std::move(callback), _InlineExecutor());
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Callback, typename Executor>
+    void BloomFilterLock<T, W, M, I, S, R>::async_multilock(const IntentionType& l, Callback callback, Executor executor)
+    {
+        async_lock_request(_IntentionRequest<S>{l}, std::move(callback), std::move(executor));
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Callback>
+    void BloomFilterLock<T, W, M, I, S, R>::async_read_lock(KeyType resource_id, Callback callback)
+    {
+        async_lock_request(_ReadKeyRequest<S>{resource_id}, std::move(callback), _InlineExecutor());
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Callback, typename Executor>
+    void BloomFilterLock<T, W, M, I, S, R>::async_read_lock(KeyType resource_id, Callback callback, Executor executor)
+    {
+        async_lock_request(_ReadKeyRequest<S>{resource_id}, std::move(callback), std::move(executor));
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Callback>
+    void BloomFilterLock<T, W, M, I, S, R>::async_write_lock(KeyType resource_id, Callback callback)
+    {
+        async_lock_request(_WriteKeyRequest<S>{resource_id}, std::move(callback), _InlineExecutor());
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Callback, typename Executor>
+    void BloomFilterLock<T, W, M, I, S, R>::async_write_lock(KeyType resource_id, Callback callback, Executor executor)
+    {
+        async_lock_request(_WriteKeyRequest<S>{resource_id}, std::move(callback), std::move(executor));
+    }
+
+#if defined(__cpp_impl_coroutine)
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    _LockAwaiter<BloomFilterLock<T, W, M, I, S, R>, _IntentionRequest<S>> BloomFilterLock<T, W, M, I, S, R>::async_multilock(
+        const IntentionType& l)
+    {
+        return _LockAwaiter<BloomFilterLock, _IntentionRequest<S>>(*this, _IntentionRequest<S>{l});
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    _LockAwaiter<BloomFilterLock<T, W, M, I, S, R>, _ReadKeyRequest<S>> BloomFilterLock<T, W, M, I, S, R>::async_read_lock(KeyType resource_id)
+    {
+        return _LockAwaiter<BloomFilterLock, _ReadKeyRequest<S>>(*this, _ReadKeyRequest<S>{resource_id});
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    _LockAwaiter<BloomFilterLock<T, W, M, I, S, R>, _WriteKeyRequest<S>> BloomFilterLock<T, W, M, I, S, R>::async_write_lock(
+        KeyType resource_id)
+    {
+        return _LockAwaiter<BloomFilterLock, _WriteKeyRequest<S>>(*this, _WriteKeyRequest<S>{resource_id});
+    }
+#endif
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Request>
+    bool BloomFilterLock<T, W, M, I, S, R>::async_lock_request(const Request& request, _AsyncWaiter* waiter)
+    {
+        // Returns false if the lock was acquired straight away, waiter is resumed otherwise.
+        return enqueue_request(request)->add_async_waiter(waiter);
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Request, typename Callback, typename Executor>
+    void BloomFilterLock<T, W, M, I, S, R>::async_lock_request(const Request& request, Callback&& callback,
+                                                      Executor&& executor)
+    {
+        using Waiter = _AsyncCallbackWaiter<std::decay_t<Callback>, std::decay_t<Executor>>;
+        auto waiter = new Waiter(std::move(callback), std::move(executor));
+        if (not async_lock_request(request, waiter))
+        {
+            std::unique_ptr<Waiter> acquired(waiter);
+            acquired->m_callback();
+        }
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Request>
+    _LockRecord<S>* BloomFilterLock<T, W, M, I, S, R>::merge_in_window(const Request& request)
+    {
+        // m_mutex must be held. Returns the record the request was merged into or nullptr.
+        if (m_merge_window_policy == FirstFit)
+        {
+            size_t depth = 0;
+            for (auto r = m_lock_queue.front(); r && depth < m_merge_window; r = m_lock_queue.next(r), ++depth)
+            {
+                if (merge_into(request, r))
+                {
+                    ++m_merges_at_depth[depth];
+                    return r;
+                }
+            }
+            return nullptr;
+        }
+
+        // Ordered: a record is only eligible if no record queued behind it conflicts with the request, so
+        // the whole queue is scanned from the back.
+        m_window_records.clear();
+        for (auto r = m_lock_queue.front(); r; r = m_lock_queue.next(r))
+            m_window_records.push_back(r);
+
+        size_t eligible = m_window_records.size();
+        while (eligible > 0 && request.compatible_with(m_window_records[eligible - 1]))
+            --eligible;
+
+        // Records from eligible onwards have no conflicting record behind them.
+        for (size_t depth = eligible; depth < std::min(m_window_records.size(), m_merge_window); ++depth)
+        {
+            if (merge_into(request, m_window_records[depth]))
+            {
+                ++m_merges_at_depth[depth];
+                return m_window_records[depth];
+            }
+        }
+        return nullptr;
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Request>
+    bool BloomFilterLock<T, W, M, I, S, R>::merge_into(const Request& request, Record* r)
+    {
+        // m_mutex must be held.
+        auto result = request.merge_into(r, m_merge_policy);
+        m_merge_policy.observe(result, m_lock_queue);
+        if constexpr (_traces<I>::value)
+            m_instrumentation.trace_merge(r, request.fast_summary(), result);
+        if constexpr (I::enabled)
+        {
+            m_instrumentation.merge_attempt(r == m_lock_queue.front(), Record::merged(result));
+            // Keyed requests only close a record by reaching the request limit.
+            if (Record::merged(result) && r->record_type() == Record::Exclusive)
+                m_instrumentation.record_closed_by_limit();
+        }
+        return Record::merged(result);
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Request>
+    _LockRecord<S>* BloomFilterLock<T, W, M, I, S, R>::join_active_record(const Request& request)
+    {
+        // m_mutex must be held. Returns the active record if the request joined it or nullptr.
+        if (m_active_joins >= m_max_active_joins)
+            return nullptr;
+
+        // The active record may run alongside biased readers when it was activated without writes.
+        if (m_read_bias_enabled && request.num_writes() &&
+            (m_read_bias.load(std::memory_order_relaxed) || m_read_bias_draining.load(std::memory_order_relaxed)))
+            return nullptr;
+
+        auto active = m_active_lock_record.load(std::memory_order_relaxed);
+        if (not active)
+            return nullptr;
+
+        // Joining runs the request ahead of every queued record.
+        for (auto r = m_lock_queue.front(); r; r = m_lock_queue.next(r))
+        {
+            if (r->record_type() != Record::None && not request.compatible_with(r))
+                return nullptr;
+        }
+
+        if (not active->join([&]() {return merge_into(request, active);}))
+            return nullptr;
+        ++m_active_joins;
+        return active;
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    bool BloomFilterLock<T, W, M, I, S, R>::try_biased_read_lock()
+    {
+        if (not m_read_bias.load(std::memory_order_relaxed))
+            return false;
+
+        // Entries are shared with other threads and locks, a taken entry just means taking the queue.
+        auto& visible_reader = _visible_readers()[_visible_reader_index(this)];
+        const void* expected = nullptr;
+        if (not visible_reader.compare_exchange_strong(expected, this, std::memory_order_seq_cst))
+            return false;
+
+        // seq_cst pairs with revoke_read_bias, which clears the bias before it looks for visible readers.
+        if (m_read_bias.load(std::memory_order_seq_cst))
+        {
+            tl_biased_reads().track(this);
+            return true;
+        }
+
+        release_biased_read_lock();
+        return false;
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    void BloomFilterLock<T, W, M, I, S, R>::release_biased_read_lock()
+    {
+        _visible_readers()[_visible_reader_index(this)].store(nullptr, std::memory_order_seq_cst);
+        if (not m_read_bias_draining.load(std::memory_order_seq_cst))
+            return;
+
+        // A revocation is waiting for the biased readers, the last of them activates the queue.
+        std::unique_lock<T> guard(m_mutex);
+        if (not m_read_bias_draining.load(std::memory_order_relaxed) || biased_readers_present())
+            return;
+
+        end_revocation();
+        _AsyncWaiter* activated = nullptr;
+        Record* spare = nullptr;
+        if (not m_active_lock_record.load(std::memory_order_relaxed))
+            activated = activate_queue_front(spare);
+        guard.unlock();
+        _AsyncWaiter::resume_all(activated);
+        if (spare)
+            free_lock_record(spare);
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    void BloomFilterLock<T, W, M, I, S, R>::restore_read_bias()
+    {
+        // Called by a global read holding the queue, which no write runs alongside. A pending revocation
+        // means a write is waiting for the biased readers to drain.
+        if (m_read_bias.load(std::memory_order_relaxed) || m_read_bias_draining.load(std::memory_order_relaxed))
+            return;
+
+        auto now = uint64_t(std::chrono::steady_clock::now().time_since_epoch().count());
+        if (now >= m_read_bias_inhibited_until.load(std::memory_order_relaxed))
+            m_read_bias.store(true, std::memory_order_seq_cst);
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    bool BloomFilterLock<T, W, M, I, S, R>::revoke_read_bias()
+    {
+        // m_mutex must be held. Returns true if no biased reader holds the lock. Otherwise the revocation
+        // stays pending until the last biased reader releases and activates the queue.
+        if (m_read_bias_draining.load(std::memory_order_relaxed))
+            return false;
+        // Readers only take the bias once it is restored, so there is nothing to drain without it.
+        if (not m_read_bias.load(std::memory_order_relaxed))
+            return true;
+
+        m_revocation_start = std::chrono::steady_clock::now();
+        m_read_bias.store(false, std::memory_order_seq_cst);
+        m_read_bias_draining.store(true, std::memory_order_seq_cst);
+        if (biased_readers_present())
+            return false;
+
+        end_revocation();
+        return true;
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    void BloomFilterLock<T, W, M, I, S, R>::end_revocation()
+    {
+        // m_mutex must be held. As in BRAVO the bias is inhibited for 9 times the revocation took, which
+        // bounds the time writes spend revoking to about a tenth.
+        auto now = std::chrono::steady_clock::now();
+        m_read_bias_inhibited_until.store((now + 9 * (now - m_revocation_start)).time_since_epoch().count(),
+                                          std::memory_order_relaxed);
+        m_read_bias_draining.store(false, std::memory_order_relaxed);
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    bool BloomFilterLock<T, W, M, I, S, R>::biased_readers_present() const
+    {
+        auto visible_readers = _visible_readers();
+        for (size_t i = 0; i < _num_visible_readers; ++i)
+        {
+            if (visible_readers[i].load(std::memory_order_seq_cst) == this)
+                return true;
+        }
+        return false;
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    MergeWindowStats BloomFilterLock<T, W, M, I, S, R>::merge_window_stats()
+    {
+        std::unique_lock<T> lock(m_mutex);
+        return MergeWindowStats{m_merges_at_depth, m_unmerged.load(std::memory_order_relaxed)};
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    SchedulingStats BloomFilterLock<T, W, M, I, S, R>::scheduling_stats()
+    {
+        std::unique_lock<T> lock(m_mutex);
+        return m_scheduling_stats;
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    LockStats BloomFilterLock<T, W, M, I, S, R>::stats() const
+    {
+        return m_instrumentation.snapshot();
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    void BloomFilterLock<T, W, M, I, S, R>::unlock()
+    {        
+        m_tracking.untrack(this);
+        m_tracking.template release<S>(this);
+        if (m_read_bias_enabled && tl_biased_reads().tracked(this))
+        {
+            tl_biased_reads().untrack(this);
+            release_biased_read_lock();
+            return;
+        }
+        // Queued records are only activated once the fast path holders have drained, so the caller is one
+        // of them as long as there are any.
+        if (_FastPath::held(m_fast_state))
+        {
+            release_fast_lock();
+            return;
+        }
+        release_active_record();
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    void BloomFilterLock<T, W, M, I, S, R>::release_fast_lock()
+    {
+        if (_FastPath::release(m_fast_state))
+            activate_if_idle();
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    bool BloomFilterLock<T, W, M, I, S, R>::unlock(KeyType key)
+    {
+        return unlock(IntentionType::from_read_key(key));
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    bool BloomFilterLock<T, W, M, I, S, R>::unlock(const IntentionType& part)
+    {
+        // Only the keys of the request of the caller are counted for it, see _HeldIntention.
+        std::unique_lock<T> guard(m_mutex);
+        Record* active;
+        auto held = held_request(active);
+        if (not held || held->m_global_write || not held->m_intention._release_exact_keys(part))
+            return false;
+        if (not active->release_part(part))
+            return true;
+        auto activated = absorb_queue_front(active);
+        guard.unlock();
+        _AsyncWaiter::resume_all(activated);
+        return true;
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    _HeldIntention<S>* BloomFilterLock<T, W, M, I, S, R>::held_request(Record*& active)
+    {
+        auto held = m_tracking.template held<S>(this);
+        active = m_active_lock_record.load(std::memory_order_relaxed);
+        if (not held)
+            return nullptr;
+        // Records absorbed by partial releases are held through the active record.
+        for (auto r = active; r; r = r->m_absorbed)
+        {
+            if (r == held->m_record)
+                return held;
+        }
+        return nullptr;
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    _AsyncWaiter* BloomFilterLock<T, W, M, I, S, R>::absorb_queue_front(Record* active)
+    {
+        // m_mutex must be held. Activates the records at the front of the queue as part of the active
+        // record while they are compatible with it, in queue order. Returns their asynchronous waiters.
+        _AsyncWaiter* activated = nullptr;
+        while (1)
+        {
+            auto front = m_lock_queue.front();
+            auto next = m_lock_queue.next(front);
+            if (front->record_type() == Record::None)
+            {
+                if (not next)
+                    break;
+                m_lock_queue.pop(nullptr);
+                free_lock_record(front);
+                continue;
+            }
+
+            if (m_read_bias_enabled && front->writes() && not revoke_read_bias())
+                break;
+            if (not active->absorb(front, m_merge_policy.exact_keys()))
+                break;
+
+            Record* spare = next ? nullptr : allocate_lock_record();
+            if (not m_lock_queue.pop(spare) && spare)
+                free_lock_record(spare);
+            trace_activate(front);
+            if (auto waiters = front->activate(_wake_fanout<W>::value))
+            {
+                auto last = waiters;
+                while (last->m_next)
+                    last = last->m_next;
+                last->m_next = activated;
+                activated = waiters;
+            }
+        }
+        return activated;
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    bool BloomFilterLock<T, W, M, I, S, R>::downgrade(const IntentionType& reads_only)
+    {
+        if (reads_only.m_min_writes)
+            std::terminate();
+        std::unique_lock<T> guard(m_mutex);
+        Record* active;
+        auto held = held_request(active);
+        if (not held || not active->downgrade(held->m_intention, held->m_global_write, reads_only))
+            return false;
+        held->m_global_write = false;
+        held->m_intention = reads_only;
+        auto activated = absorb_queue_front(active);
+        guard.unlock();
+        _AsyncWaiter::resume_all(activated);
+        return true;
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    bool BloomFilterLock<T, W, M, I, S, R>::try_upgrade(KeyType key)
+    {
+        std::unique_lock<T> guard(m_mutex);
+        Record* active;
+        auto held = held_request(active);
+        if (not held)
+            return false;
+        if (held->m_global_write)
+            return true;
+        // A record activated without writes may run alongside biased readers.
+        if (m_read_bias_enabled && not active->writes() && not revoke_read_bias())
+            return false;
+        if (not active->upgrade(key, held->m_intention))
+            return false;
+        if (not held->m_intention._flip_exact_key(key))
+            held->m_intention.add_write_key(key);
+        return true;
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Fn>
+    void BloomFilterLock<T, W, M, I, S, R>::execute(const IntentionType& l, Fn&& fn)
+    {
+        _IntentionRequest<S> request{l};
+        if (try_fast_lock(request.fast_summary()))
+        {
+            try
+            {
+                fn();
+            }
+            catch (...)
+            {
+                release_fast_lock();
+                throw;
+            }
+            release_fast_lock();
+            return;
+        }
+
+        _ExecuteWaiter<BloomFilterLock, std::remove_reference_t<Fn>> waiter(*this, fn);
+        if (async_lock_request(request, &waiter))
+            m_wait_policy.wait(waiter.m_done);
+        else
+            waiter.run();
+
+        if (waiter.m_exception)
+            std::rethrow_exception(waiter.m_exception);
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    std::vector<BatchHandle<BloomFilterLock<T, W, M, I, S, R>>> BloomFilterLock<T, W, M, I, S, R>::multilock_batch(
+        const std::vector<IntentionType>& intentions)
+    {
+        std::vector<BatchHandle<BloomFilterLock>> handles(intentions.size());
+        // batch holds the records queued for the batch, touched every record it latched into.
+        std::vector<Record*> batch;
+        std::vector<Record*> touched;
+        auto start = m_instrumentation.now();
+        _AsyncWaiter* activated = nullptr;
+        Record* spare = nullptr;
+
+        std::unique_lock<T> guard(m_mutex);
+        for (size_t i = 0; i < intentions.size(); ++i)
+        {
+            _IntentionRequest<S> request{intentions[i]};
+            // Joining counts the request as waiting on the active record, the other records are latched.
+            auto r = join_active_record(request);
+            if (not r)
+            {
+                // Records are only passed over under a SchedulingPolicy other than Fifo, the batch then only
+                // latches into the records it allocated, which are not passed over by its later records.
+                if ((m_scheduling != Fifo || not (r = merge_in_window(request))) &&
+                    not (r = pack_batch_request(request, batch)))
+                {
+                    r = allocate_lock_record();
+                    request.merge_into(r, m_merge_policy);
+                    m_unmerged.fetch_add(1, std::memory_order_relaxed);
+                    // Passing over the record could activate a later handle of the batch before an earlier one.
+                    r->m_barrier = true;
+                    trace_enqueue(r);
+                    m_lock_queue.push(r);
+                    batch.push_back(r);
+                }
+                r->_latch();
+            }
+            if (std::find(touched.begin(), touched.end(), r) == touched.end())
+                touched.push_back(r);
+
+            auto& handle = handles[i];
+            handle.m_lock = this;
+            handle.m_record = r;
+            handle.m_start = start;
+            handle.m_index = i;
+            handle.m_state = BatchHandle<BloomFilterLock>::Queued;
+        }
+
+        // The records are activated in queue order after the active record.
+        std::vector<std::pair<Record*, size_t>> order;
+        order.reserve(touched.size());
+        order.emplace_back(m_active_lock_record.load(std::memory_order_relaxed), 0);
+        size_t position = 1;
+        for (auto r = m_lock_queue.front(); r && order.size() <= touched.size(); r = m_lock_queue.next(r), ++position)
+        {
+            if (std::find(touched.begin(), touched.end(), r) != touched.end())
+                order.emplace_back(r, position);
+        }
+        auto position_of = [&order, position](Record* r)
+        {
+            auto it = std::find_if(order.begin(), order.end(), [r](const auto& o) {return o.first == r;});
+            return it != order.end() ? it->second : position;
+        };
+        std::stable_sort(handles.begin(), handles.end(), [&](const auto& lhs, const auto& rhs)
+                         {return position_of(lhs.m_record) < position_of(rhs.m_record);});
+
+        if (not m_active_lock_record.load(std::memory_order_relaxed))
+            activated = activate_queue_front(spare);
+        guard.unlock();
+
+        _AsyncWaiter::resume_all(activated);
+        if (spare)
+            free_lock_record(spare);
+        return handles;
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    template <typename Request>
+    _LockRecord<S>* BloomFilterLock<T, W, M, I, S, R>::pack_batch_request(const Request& request,
+                                                                          const std::vector<Record*>& batch)
+    {
+        size_t first = 0;
+        if (m_merge_window_policy == Ordered && not batch.empty())
+        {
+            // Requests enqueued without m_mutex may have been pushed between the records of the batch.
+            size_t seen = 0;
+            for (auto r = batch.front(); r; r = m_lock_queue.next(r))
+            {
+                if (seen < batch.size() && r == batch[seen])
+                    ++seen;
+                if (not request.compatible_with(r))
+                    first = seen;
+            }
+        }
+
+        for (size_t i = first; i < batch.size(); ++i)
+        {
+            if (merge_into(request, batch[i]))
+                return batch[i];
+        }
+        return nullptr;
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    void BloomFilterLock<T, W, M, I, S, R>::async_unlock()
+    {
+        release_active_record();
+    }
+
+
+    template <typename T, typename W, typename M, typename I, size_t S, typename R>
+    void BloomFilterLock<T, W, M, I, S, R>::release_active_record()
+    {
+        // valgrind seems to fail to establish happens-before on the
+        // update to m_active_lock_record in a previous unlock op w/o
+        // this spinlock. From my understanding of happens-before, it should
+        // not strictly be necessary as happens-before for this is established
+        // by the spinlock held in the activate call itself.        
+        auto released_lock_record = m_active_lock_record.load(std::memory_order_acquire);
+        
+        if (released_lock_record->release())
+        {
+            // This thread is responsible for clearing the lock record and activating the next one.                 
+            m_instrumentation.held(released_lock_record->m_activation_time);
+            if constexpr (_traces<I>::value)
+                m_instrumentation.trace_release(released_lock_record);
+            // Records absorbed by partial releases are done once every holder has released.
+            for (auto r = released_lock_record->m_absorbed; r; r = released_lock_record->m_absorbed)
+            {
+                released_lock_record->m_absorbed = r->m_absorbed;
+                r->clear();
+                free_lock_record(r);
+            }
+            // A request joining the active record reads it under m_mutex.
+            if (not m_max_active_joins)
+                released_lock_record->clear();                                        
+            std::unique_lock<T> guard(m_mutex);
+            if (m_max_active_joins)
+                released_lock_record->clear();
+            // seq_cst pairs with the check for an active record in requests enqueued without m_mutex.
+            m_active_lock_record.store(nullptr, std::memory_order_seq_cst);
+            auto activated = activate_queue_front(released_lock_record);
+            guard.unlock();
+            // The next batch is woken before the released record is recycled.
+            _AsyncWaiter::resume_all(activated);
+            if (released_lock_record)
+                free_lock_record(released_lock_record);
+        }
+    }
+
+
+    template <typename L, size_t N>
+    void ShardedBloomFilterLock<L, N>::global_read_lock()
+    {
+        for (auto& shard: m_shards)
+            shard.global_read_lock();
+        set_held_shards(~uint64_t(0) >> (64 - N));
+    }
+
+
+    template <typename L, size_t N>
+    void ShardedBloomFilterLock<L, N>::global_write_lock()
+    {
+        for (auto& shard: m_shards)
+            shard.global_write_lock();
+        set_held_shards(~uint64_t(0) >> (64 - N));
+    }
+
+
+    template <typename L, size_t N>
+    template <typename T>
+    void ShardedBloomFilterLock<L, N>::multilock(const T& reads, const T& writes)
+    {
+        // Route each key to its own shard so every shard only sees the keys it owns.
+        IntentionType intentions[N];
+        uint64_t shards = 0;
+        for (auto key: reads)
+        {
+            if (key.value() == 0)
+                continue;
+            auto index = shard_index(key);
+            intentions[index].add_read_key(key);
+            shards |= uint64_t(1) << index;
+        }
+
+        for (auto key: writes)
+        {
+            if (key.value() == 0)
+                continue;
+            auto index = shard_index(key);
+            intentions[index].add_write_key(key);
+            shards |= uint64_t(1) << index;
+        }
+        lock_shards(intentions, shards);
+    }
+
+
+    template <typename L, size_t N>
+    void ShardedBloomFilterLock<L, N>::multilock(const IntentionType& l)
+    {
+        IntentionType intentions[N];
+        uint64_t shards = 0;
+        if (l.m_num_exact_keys != IntentionType::exact_keys_unknown)
+        {
+            // The kept keys are all of the keys of the intention, route them like multilock(reads, writes).
+            for (size_t k = 0; k < l.m_num_exact_keys; ++k)
+            {
+                KeyType key(l.m_exact_keys[k]);
+                auto index = shard_index(key);
+                if ((l.m_exact_writes >> k) & 1)
+                    intentions[index].add_write_key(key);
+                else
+                    intentions[index].add_read_key(key);
+                shards |= uint64_t(1) << index;
+            }
+            lock_shards(intentions, shards);
+            return;
+        }
+
+        // Otherwise split it on the slot 0 indicators. The other slots and the prefix indicators are copied
+        // to every shard which can only add false conflicts.
+        for (size_t index = 0; index < N; ++index)
+        {
+            uint64_t read_bits = l.m_read_indicators[0] & shard_mask(index);
+            if (not read_bits)
+                continue;
+
+            uint64_t write_bits = l.m_write_indicators[0] & shard_mask(index);
+            IntentionType& shard_intention = intentions[index];
+            shard_intention = l;
+            // None of the keys of l are known to belong to this shard.
+            shard_intention.m_num_exact_keys = IntentionType::exact_keys_unknown;
+            shard_intention.m_read_indicators[0] = read_bits;
+            shard_intention.m_write_indicators[0] = write_bits;
+            // Each distinct slot 0 value is at least one distinct key.
+            shard_intention.m_min_reads = std::min<uint32_t>(l.m_min_reads, __builtin_popcountll(read_bits));
+            shard_intention.m_min_writes = std::min<uint32_t>(l.m_min_writes, __builtin_popcountll(write_bits));
+            if (write_bits && not shard_intention.m_min_writes)
+                shard_intention.m_min_writes = 1;
+            shards |= uint64_t(1) << index;
+        }
+        lock_shards(intentions, shards);
+    }
+
+
+    template <typename L, size_t N>
+    void ShardedBloomFilterLock<L, N>::read_lock(KeyType resource_id)
+    {
+        auto index = shard_index(resource_id);
+        m_shards[index].read_lock(resource_id);
+        set_held_shards(uint64_t(1) << index);
+    }
+
+
+    template <typename L, size_t N>
+    void ShardedBloomFilterLock<L, N>::write_lock(KeyType resource_id)
+    {
+        auto index = shard_index(resource_id);
+        m_shards[index].write_lock(resource_id);
+        set_held_shards(uint64_t(1) << index);
+    }
+
+
+    template <typename L, size_t N>
+    void ShardedBloomFilterLock<L, N>::lock_shards(IntentionType (&intentions)[N], uint64_t shards)
+    {
+        // Ascending shard order is the canonical acquisition order for multi-shard requests.
+        for (auto remaining = shards; remaining; remaining &= remaining - 1)
+        {
+            auto index = __builtin_ctzll(remaining);
+            m_shards[index].multilock(intentions[index]);
+        }
+        set_held_shards(shards);
+    }
+
+
+    template <typename L, size_t N>
+    void ShardedBloomFilterLock<L, N>::set_held_shards(uint64_t shards)
+    {
+        for (auto& held: tl_held_shards())
+        {
+            if (held.first == this)
+            {
+                // Recursive locking is not allowed.
+                if (held.second)
+                    std::terminate();
+                held.second = shards;
+                return;
+            }
+        }
+        tl_held_shards().emplace_back(this, shards);
+    }
+
+
+    template <typename L, size_t N>
+    void ShardedBloomFilterLock<L, N>::unlock()
+    {
+        for (auto& held: tl_held_shards())
+        {
+            if (held.first != this)
+                continue;
+
+            auto shards = held.second;
+            held = tl_held_shards().back();
+            tl_held_shards().pop_back();
+            for (; shards; shards &= shards - 1)
+                m_shards[__builtin_ctzll(shards)].unlock();
+            return;
+        }
+        std::terminate();
+    }
+
+
+    template <typename L, size_t N>
+    HierarchicalBloomFilterLock<L, N>::~HierarchicalBloomFilterLock()
+    {
+        for (auto& node: m_nodes)
+        {
+            for (auto batch: node.m_free_batches)
+                delete batch;
+        }
+    }
+
+
+    template <typename L, size_t N>
+    size_t HierarchicalBloomFilterLock<L, N>::current_node()
+    {
+        static thread_local size_t node = []()
+        {
+            unsigned cpu = 0;
+            unsigned node = 0;
+            if (syscall(SYS_getcpu, &cpu, &node, nullptr) == -1)
+                return size_t(0);
+            return size_t(node % N);
+        }();
+        return node;
+    }
+
+
+    template <typename L, size_t N>
+    void HierarchicalBloomFilterLock<L, N>::global_read_lock()
+    {
+        lock_request(_LockRecordBase::ReadOnly, IntentionType());
+    }
+
+
+    template <typename L, size_t N>
+    void HierarchicalBloomFilterLock<L, N>::global_write_lock()
+    {
+        set_held_batch(nullptr);
+        m_global.global_write_lock();
+    }
+
+
+    template <typename L, size_t N>
+    template <typename T>
+    void HierarchicalBloomFilterLock<L, N>::multilock(const T& reads, const T& writes)
+    {
+        multilock(IntentionType(reads, writes));
+    }
+
+
+    template <typename L, size_t N>
+    void HierarchicalBloomFilterLock<L, N>::multilock(const IntentionType& l)
+    {
+        lock_request(_LockRecordBase::ReadWrite, l);
+    }
+
+
+    template <typename L, size_t N>
+    void HierarchicalBloomFilterLock<L, N>::read_lock(KeyType resource_id)
+    {
+        multilock(IntentionType::from_read_key(resource_id));
+    }
+
+
+    template <typename L, size_t N>
+    void HierarchicalBloomFilterLock<L, N>::write_lock(KeyType resource_id)
+    {
+        multilock(IntentionType::from_write_key(resource_id));
+    }
+
+
+    template <typename L, size_t N>
+    void HierarchicalBloomFilterLock<L, N>::lock_request(_LockRecordBase::RecordType type, const IntentionType& l)
+    {
+        auto& node = m_nodes[current_node()];
+        std::unique_lock<std::mutex> guard(node.m_mutex);
+        auto batch = node.m_open;
+        if (batch)
+        {
+            if (batch->m_type == type && (type == _LockRecordBase::ReadOnly || batch->m_lock_intention.merge(l)))
+            {
+                batch->m_num_locking.fetch_add(1, std::memory_order_relaxed);
+                guard.unlock();
+                set_held_batch(batch);
+                batch->m_futex.wait();
+                return;
+            }
+
+            guard.unlock();
+            set_held_batch(nullptr);
+            lock_global(type, l);
+            return;
+        }
+
+        if (node.m_free_batches.empty())
+        {
+            batch = new _Batch();
+        }
+        else
+        {
+            batch = node.m_free_batches.back();
+            node.m_free_batches.pop_back();
+        }
+        batch->m_type = type;
+        batch->m_lock_intention = l;
+        batch->m_num_locking.store(1, std::memory_order_relaxed);
+        batch->m_futex.reset();
+        node.m_open = batch;
+        set_held_batch(batch);
+
+        // The batch collects requests for as long as the batch ahead of it waits on the global lock.
+        node.m_granted.wait(guard, [&node]() {return not node.m_queued;});
+        node.m_open = nullptr;
+        node.m_queued = true;
+        guard.unlock();
+
+        lock_global(type, batch->m_lock_intention);
+        guard.lock();
+        node.m_queued = false;
+        guard.unlock();
+        node.m_granted.notify_one();
+        batch->m_futex.signal();
+    }
+
+
+    template <typename L, size_t N>
+    void HierarchicalBloomFilterLock<L, N>::lock_global(_LockRecordBase::RecordType type, const IntentionType& l)
+    {
+        if (type == _LockRecordBase::ReadOnly)
+            m_global.global_read_lock();
+        else
+            m_global.multilock(l);
+    }
+
+
+    template <typename L, size_t N>
+    void HierarchicalBloomFilterLock<L, N>::set_held_batch(_Batch* batch)
+    {
+        // Recursive locking is not allowed.
+        for (auto& held: tl_held_batches())
+        {
+            if (held.first == this)
+                std::terminate();
+        }
+        tl_held_batches().emplace_back(this, batch);
+    }
+
+
+    template <typename L, size_t N>
+    void HierarchicalBloomFilterLock<L, N>::unlock()
+    {
+        for (auto& held: tl_held_batches())
+        {
+            if (held.first != this)
+                continue;
+
+            auto batch = held.second;
+            held = tl_held_batches().back();
+            tl_held_batches().pop_back();
+            if (batch && batch->m_num_locking.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                return;
+
+            m_global.unlock();
+            if (batch)
+            {
+                // Members of a batch share the node of its leader.
+                auto& node = m_nodes[current_node()];
+                std::unique_lock<std::mutex> guard(node.m_mutex);
+                node.m_free_batches.push_back(batch);
+            }
+            return;
+        }
+        std::terminate();
+    }
+
+
+    template <typename L>
+    void LockSet<L>::lock()
+    {
+        std::sort(m_entries.begin(), m_entries.end(),
+                  [](const Entry& lhs, const Entry& rhs) {return std::less<L*>()(lhs.first, rhs.first);});
+        for (size_t i = 1; i < m_entries.size(); ++i)
+        {
+            if (m_entries[i - 1].first == m_entries[i].first)
+                std::terminate();
+        }
+
+        for (auto& entry: m_entries)
+            entry.first->m_tracking.track(entry.first);
+
+        std::vector<std::pair<typename L::Record*, uint64_t>> queued;
+        queued.reserve(m_entries.size());
+        {
+            std::unique_lock<std::mutex> guard(_lock_set_mutex());
+            for (auto& entry: m_entries)
+            {
+                auto start = entry.first->m_instrumentation.now();
+                queued.emplace_back(entry.first->push_request(entry.second), start);
+            }
+        }
+
+        // Activating outside of the pass keeps continuations resumed by it out of _lock_set_mutex.
+        for (auto& entry: m_entries)
+            entry.first->activate_if_idle();
+        for (size_t i = 0; i < m_entries.size(); ++i)
+        {
+            m_entries[i].first->wait_on(queued[i].first, queued[i].second);
+            m_entries[i].first->hold_request(m_entries[i].second, queued[i].first);
+        }
+    }
+
+
+    template <typename L>
+    void LockSet<L>::unlock()
+    {
+        for (auto& entry: m_entries)
+            entry.first->unlock();
+    }
+
+
+    template <size_t S, size_t N, size_t M>
+    SharedBloomFilterLock<S, N, M>::SharedBloomFilterLock():
+        m_magic(0),
+        m_active(0),
+        m_queue_front(0),
+        m_queue_back(0),
+        m_free_records(1)
+    {
+        for (uint32_t r = 1; r <= N; ++r)
+            record(r).m_next = r < N ? r + 1 : 0;
+        m_magic.store(_magic, std::memory_order_release);
+    }
+
+
+    template <size_t S, size_t N, size_t M>
+    SharedBloomFilterLock<S, N, M>* SharedBloomFilterLock<S, N, M>::create(void* region)
+    {
+        if (reinterpret_cast<uintptr_t>(region) % _cache_line_size)
+            std::terminate();
+        return new (region) SharedBloomFilterLock();
+    }
+
+
+    template <size_t S, size_t N, size_t M>
+    SharedBloomFilterLock<S, N, M>* SharedBloomFilterLock<S, N, M>::attach(void* region)
+    {
+        auto lock = static_cast<SharedBloomFilterLock*>(region);
+        if (lock->m_magic.load(std::memory_order_acquire) != _magic)
+            return nullptr;
+        return lock;
+    }
+
+
+    template <size_t S, size_t N, size_t M>
+    void SharedBloomFilterLock<S, N, M>::global_read_lock()
+    {
+        lock_request(_LockRecordBase::ReadOnly, IntentionType());
+    }
+
+
+    template <size_t S, size_t N, size_t M>
+    void SharedBloomFilterLock<S, N, M>::global_write_lock()
+    {
+        lock_request(_LockRecordBase::Exclusive, IntentionType());
+    }
+
+
+    template <size_t S, size_t N, size_t M>
+    template <typename T>
+    void SharedBloomFilterLock<S, N, M>::multilock(const T& reads, const T& writes)
+    {
+        multilock(IntentionType(reads, writes));
+    }
+
+
+    template <size_t S, size_t N, size_t M>
+    void SharedBloomFilterLock<S, N, M>::multilock(const IntentionType& l)
+    {
+        lock_request(_LockRecordBase::ReadWrite, l);
+    }
+
+
+    template <size_t S, size_t N, size_t M>
+    void SharedBloomFilterLock<S, N, M>::read_lock(KeyType readKey)
+    {
+        multilock(IntentionType::from_read_key(readKey));
+    }
+
+
+    template <size_t S, size_t N, size_t M>
+    void SharedBloomFilterLock<S, N, M>::write_lock(KeyType writeKey)
+    {
+        multilock(IntentionType::from_write_key(writeKey));
+    }
+
+
+    template <size_t S, size_t N, size_t M>
+    void SharedBloomFilterLock<S, N, M>::lock_request(RecordType type, const IntentionType& l)
+    {
+        auto& held_requests = tl_held_requests();
+        for (auto& held: held_requests)
+        {
+            if (held.lock == this)
+                std::terminate();
+        }
+
+        auto pid = getpid();
+        auto recovery = std::chrono::steady_clock::now() + recovery_interval;
+        while (1)
+        {
+            uint32_t r = 0;
+            uint32_t slot = 0;
+            {
+                std::unique_lock<_SpinLock> guard(m_lock);
+                // Without an active record the queue is empty as well.
+                if (not m_active)
+                {
+                    r = new_record(type, l);
+                    m_active = r;
+                    record(r).m_futex.signal();
+                }
+                else if (not m_queue_front)
+                {
+                    if (merge_into(m_active, type, l))
+                        r = m_active;
+                    else if ((r = new_record(type, l)))
+                        m_queue_front = m_queue_back = r;
+                }
+                else if (merge_into(m_queue_front, type, l))
+                    r = m_queue_front;
+                else if (m_queue_back != m_queue_front && merge_into(m_queue_back, type, l))
+                    r = m_queue_back;
+                else if ((r = new_record(type, l)))
+                {
+                    record(m_queue_back).m_next = r;
+                    m_queue_back = r;
+                }
+
+                if (r)
+                    slot = add_request(r, pid);
+            }
+
+            if (r)
+            {
+                held_requests.push_back(_HeldRequest{this, r, slot});
+                wait_on(r);
+                return;
+            }
+
+            // The record pool is exhausted, retry once records have been completed.
+            if (std::chrono::steady_clock::now() >= recovery)
+            {
+                recover();
+                recovery = std::chrono::steady_clock::now() + recovery_interval;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+
+    template <size_t S, size_t N, size_t M>
+    bool SharedBloomFilterLock<S, N, M>::merge_into(uint32_t r, RecordType type, const IntentionType& l)
+    {
+        auto& rec = record(r);
+        if (rec.m_num_requests == M)
+            return false;
+
+        switch (rec.m_type)
+        {
+            case _LockRecordBase::ReadOnly:
+                // a count of 0 is guaranteed accurate.
+                return type == _LockRecordBase::ReadOnly || (type == _LockRecordBase::ReadWrite && l.m_min_writes == 0);
+            case _LockRecordBase::ReadWrite:
+                return type == _LockRecordBase::ReadWrite && rec.m_lock_intention.merge(l);
+            default:
+                return false;
+        }
+    }
+
+
+    template <size_t S, size_t N, size_t M>
+    uint32_t SharedBloomFilterLock<S, N, M>::add_request(uint32_t r, pid_t pid)
+    {
+        auto& rec = record(r);
+        uint32_t slot = 0;
+        while (rec.m_pids[slot])
+            ++slot;
+        rec.m_pids[slot] = pid;
+        ++rec.m_num_requests;
+        return slot;
+    }
+
+
+    template <size_t S, size_t N, size_t M>
+    uint32_t SharedBloomFilterLock<S, N, M>::new_record(RecordType type, const IntentionType& l)
+    {
+        auto r = m_free_records;
+        if (not r)
+            return 0;
+
+        auto& rec = record(r);
+        m_free_records = rec.m_next;
+        rec.m_futex.reset();
+        rec.m_type = type;
+        rec.m_next = 0;
+        rec.m_num_requests = 0;
+        std::fill(rec.m_pids, rec.m_pids + M, 0);
+        if (type == _LockRecordBase::ReadWrite)
+            rec.m_lock_intention = l;
+        else
+            rec.m_lock_intention.clear();
+        return r;
+    }
+
+
+    template <size_t S, size_t N, size_t M>
+    void SharedBloomFilterLock<S, N, M>::free_record(uint32_t r)
+    {
+        record(r).m_next = m_free_records;
+        m_free_records = r;
+    }
+
+
+    template <size_t S, size_t N, size_t M>
+    void SharedBloomFilterLock<S, N, M>::wait_on(uint32_t r)
+    {
+        // The record stays allocated for as long as the request of this thread is in it.
+        auto& futex = record(r).m_futex;
+        while (not futex.wait_until(std::chrono::steady_clock::now() + recovery_interval))
+            recover();
+    }
+
+
+    template <size_t S, size_t N, size_t M>
+    void SharedBloomFilterLock<S, N, M>::activate_queue_front()
+    {
+        while (m_queue_front)
+        {
+            auto r = m_queue_front;
+            auto& rec = record(r);
+            m_queue_front = rec.m_next;
+            if (not m_queue_front)
+                m_queue_back = 0;
+
+            // Every request of the record belonged to processes that have exited.
+            if (not rec.m_num_requests)
+            {
+                free_record(r);
+                continue;
+            }
+
+            rec.m_next = 0;
+            m_active = r;
+            // Signalled under the internal lock, once it is released recovery could complete and reuse the record.
+            rec.m_futex.signal();
+            return;
+        }
+    }
+
+
+    template <size_t S, size_t N, size_t M>
+    void SharedBloomFilterLock<S, N, M>::complete_active_record()
+    {
+        free_record(m_active);
+        m_active = 0;
+        activate_queue_front();
+    }
+
+
+    template <size_t S, size_t N, size_t M>
+    void SharedBloomFilterLock<S, N, M>::unlock()
+    {
+        auto& held_requests = tl_held_requests();
+        for (auto& held: held_requests)
+        {
+            if (held.lock != this)
+                continue;
+
+            auto r = held.record;
+            auto slot = held.slot;
+            held = held_requests.back();
+            held_requests.pop_back();
+
+            std::unique_lock<_SpinLock> guard(m_lock);
+            auto& rec = record(r);
+            rec.m_pids[slot] = 0;
+            if (not --rec.m_num_requests && r == m_active)
+                complete_active_record();
+            return;
+        }
+        std::terminate();
+    }
+
+
+    template <size_t S, size_t N, size_t M>
+    size_t SharedBloomFilterLock<S, N, M>::release_exited(uint32_t r, pid_t self)
+    {
+        auto& rec = record(r);
+        size_t released = 0;
+        for (size_t slot = 0; slot < M; ++slot)
+        {
+            auto pid = rec.m_pids[slot];
+            if (pid && pid != self && _process_exited(pid))
+            {
+                rec.m_pids[slot] = 0;
+                --rec.m_num_requests;
+                ++released;
+            }
+        }
+        return released;
+    }
+
+
+    template <size_t S, size_t N, size_t M>
+    size_t SharedBloomFilterLock<S, N, M>::recover()
+    {
+        auto self = getpid();
+        std::unique_lock<_SpinLock> guard(m_lock);
+        if (not m_active)
+            return 0;
+
+        // Records left without requests in the queue are skipped once they reach the front.
+        size_t released = release_exited(m_active, self);
+        for (auto r = m_queue_front; r; r = record(r).m_next)
+            released += release_exited(r, self);
+
+        if (not record(m_active).m_num_requests)
+            complete_active_record();
+        return released;
+    }
+}
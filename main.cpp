@@ -16,9 +16,7 @@
 typedef std::chrono::high_resolution_clock::time_point hres_t;
 typedef std::chrono::duration<size_t, std::ratio<1, 1000000>> duration_t; // micro-seconds.
 
-//using BloomFilterLock = bloomfilter_lock::BloomFilterLock<std::mutex>;
-using BloomFilterLock = bloomfilter_lock::BloomFilterLock<bloomfilter_lock::_SpinLock>;
-
+template <typename BloomFilterLock>
 struct task
 {
 
@@ -43,13 +41,13 @@ struct task
         auto resource1 = distribution(generator) | 0x01; // the bitwise or is to ensure the generated key does not get mapped to 0
         auto resource2 = distribution(generator) | 0x01;
         
-        std::vector<bloomfilter_lock::Key> reads;
-        std::vector<bloomfilter_lock::Key> writes;
+        std::vector<typename BloomFilterLock::KeyType> reads;
+        std::vector<typename BloomFilterLock::KeyType> writes;
 
         reads.push_back(resource1);
         writes.push_back(resource2);
 
-        bloomfilter_lock::LockIntention intention(reads, writes);
+        typename BloomFilterLock::IntentionType intention(reads, writes);
         
         // Wait for go...
         std::unique_lock<std::mutex> l(m_mutex);
@@ -63,7 +61,7 @@ struct task
         size_t count = 500000;
         hres_t vi_start = std::chrono::high_resolution_clock::now ();
 
-        for (auto i = 0; i < count; ++i)
+        for (size_t i = 0; i < count; ++i)
         {
             m_bloomfilter_lock.multilock(intention);
             m_bloomfilter_lock.unlock();
@@ -82,9 +80,40 @@ struct task
 };
 
 
-int main()
+template <typename BloomFilterLock>
+auto print_stats(BloomFilterLock& l, int) -> decltype(l.stats(), void())
+{
+    auto stats = l.stats();
+    if (not (stats.pooled_records + stats.allocated_records + stats.fast_path_acquisitions))
+        return;
+
+    fprintf(stderr, "front merges: %lu, rejected: %lu, back merges: %lu, rejected: %lu\n", stats.front_merges,
+            stats.front_merge_rejections, stats.back_merges, stats.back_merge_rejections);
+    fprintf(stderr, "pooled records: %lu, allocated records: %lu, closed by limit: %lu\n", stats.pooled_records,
+            stats.allocated_records, stats.records_closed_by_limit);
+    fprintf(stderr, "parked waiters: %lu, max queue depth: %lu, fast path acquisitions: %lu\n", stats.parked_waiters,
+            stats.max_queue_depth, stats.fast_path_acquisitions);
+    fprintf(stderr, "wait time histogram (log2 ns):");
+    for (auto count: stats.wait_time_histogram)
+        fprintf(stderr, " %lu", count);
+    fprintf(stderr, "\nhold time histogram (log2 ns):");
+    for (auto count: stats.hold_time_histogram)
+        fprintf(stderr, " %lu", count);
+    fprintf(stderr, "\n");
+}
+
+
+template <typename BloomFilterLock>
+void print_stats(BloomFilterLock&, long)
+{
+}
+
+
+template <typename BloomFilterLock, typename... Args>
+void run_benchmark(const char* name, Args... args)
 {
-    BloomFilterLock l;
+    BloomFilterLock l(args...);
+    fprintf(stderr, "%s:\n", name);
     auto num_cores = std::thread::hardware_concurrency();
     
     size_t concurrency = num_cores > 2 ? num_cores - 1 : num_cores;
@@ -95,9 +124,9 @@ int main()
 
     std::vector<std::thread> threads;
 
-    for (auto i = 0; i < concurrency; ++i)
+    for (size_t i = 0; i < concurrency; ++i)
     {
-        task t (l, m, v, runbool);
+        task<BloomFilterLock> t (l, m, v, runbool);
         threads.push_back(std::thread(t));
     }
 
@@ -106,5 +135,134 @@ int main()
     v.notify_all();
 
     std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+    print_stats(l, 0);
+}
+
+
+template <typename BloomFilterLock, typename... Args>
+void run_single_key_benchmark(const char* name, Args... args)
+{
+    // Compares the single key path against the same request made through multilock.
+    BloomFilterLock l(args...);
+    fprintf(stderr, "%s single key:\n", name);
+    bloomfilter_lock::Key key(rand() | 0x01);
+    std::array<bloomfilter_lock::Key, 1> reads = {key};
+    std::array<bloomfilter_lock::Key, 1> writes = {bloomfilter_lock::Key(0)};
+    size_t count = 1000000;
+
+    hres_t start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < count; ++i)
+    {
+        l.read_lock(key);
+        l.unlock();
+    }
+    duration_t timespan = std::chrono::duration_cast<duration_t>(std::chrono::high_resolution_clock::now() - start);
+    fprintf(stderr, "Time for %ld read_lock(k) cycles: %ld micro-seconds\n", count, timespan.count());
+
+    start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < count; ++i)
+    {
+        l.multilock(reads, writes);
+        l.unlock();
+    }
+    timespan = std::chrono::duration_cast<duration_t>(std::chrono::high_resolution_clock::now() - start);
+    fprintf(stderr, "Time for %ld multilock({k},{}) cycles: %ld micro-seconds\n", count, timespan.count());
+
+    // The intention of a fixed key is computed at compile time.
+    static constexpr auto fixed_intention = bloomfilter_lock::make_intention<0x01020304>();
+    start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < count; ++i)
+    {
+        l.multilock(fixed_intention);
+        l.unlock();
+    }
+    timespan = std::chrono::duration_cast<duration_t>(std::chrono::high_resolution_clock::now() - start);
+    fprintf(stderr, "Time for %ld multilock(make_intention<k>()) cycles: %ld micro-seconds\n", count, timespan.count());
+
+    typename BloomFilterLock::IntentionType intention(reads, writes);
+    size_t executed = 0;
+    start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < count; ++i)
+        l.execute(intention, [&executed]() {++executed;});
+    timespan = std::chrono::duration_cast<duration_t>(std::chrono::high_resolution_clock::now() - start);
+    fprintf(stderr, "Time for %ld execute({k},{}) cycles: %ld micro-seconds\n", executed, timespan.count());
+
+    // A batch takes the internal lock once for all of its intentions.
+    std::vector<typename BloomFilterLock::IntentionType> batch(16, intention);
+    size_t batched = 0;
+    start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < count / batch.size(); ++i)
+    {
+        for (auto& handle: l.multilock_batch(batch))
+        {
+            handle.wait();
+            handle.unlock();
+            ++batched;
+        }
+    }
+    timespan = std::chrono::duration_cast<duration_t>(std::chrono::high_resolution_clock::now() - start);
+    fprintf(stderr, "Time for %ld multilock_batch({k},{}) requests: %ld micro-seconds\n", batched, timespan.count());
+
+    // Conflicting intentions of a batch get records of their own and are granted one after another.
+    typedef typename BloomFilterLock::IntentionType IntentionType;
+    std::vector<IntentionType> conflicting = {IntentionType({}, {key}), IntentionType({key}, {}),
+                                              IntentionType({}, {key}), IntentionType({key}, {})};
+    std::vector<bool> granted(conflicting.size());
+    size_t failures = 0;
+    for (auto& handle: l.multilock_batch(conflicting))
+    {
+        handle.wait();
+        bool excluded = false;
+        // Every intention of the batch reads key, so a write from another thread must not get in.
+        std::thread([&l, &excluded, key]()
+        {
+            excluded = not l.try_write_lock(key);
+            if (not excluded)
+                l.unlock();
+        }).join();
+        failures += not handle.held() || not excluded || granted[handle.index()];
+        granted[handle.index()] = true;
+        handle.unlock();
+    }
+    failures += std::count(granted.begin(), granted.end(), false);
+    fprintf(stderr, "Conflicting multilock_batch handles: %ld, failed checks: %ld\n", conflicting.size(), failures);
+}
+
+
+int main()
+{
+    // The internal lock guards the queue of lock records and is the main point of contention
+    // at hardware_concurrency() - 1 threads.
+    run_benchmark<bloomfilter_lock::BloomFilterLock<std::mutex>>("std::mutex");
+    run_benchmark<bloomfilter_lock::BloomFilterLock<bloomfilter_lock::_SpinLock>>("_SpinLock");
+    run_benchmark<bloomfilter_lock::BloomFilterLock<bloomfilter_lock::_TicketSpinLock>>("_TicketSpinLock");
+    run_benchmark<bloomfilter_lock::BloomFilterLock<bloomfilter_lock::_SpinLock, bloomfilter_lock::FutexWaitPolicy,
+        bloomfilter_lock::FixedMergeLimits<>, bloomfilter_lock::StripedInstrumentation<>>>("_SpinLock instrumented");
+    run_benchmark<bloomfilter_lock::BloomFilterLock<bloomfilter_lock::_SpinLock, bloomfilter_lock::FutexWaitPolicy,
+        bloomfilter_lock::FixedMergeLimits<>, bloomfilter_lock::UsdtInstrumentation<>>>("_SpinLock traced");
+    run_benchmark<bloomfilter_lock::ShardedBloomFilterLock<bloomfilter_lock::BloomFilterLock<bloomfilter_lock::_SpinLock>>>(
+        "ShardedBloomFilterLock<_SpinLock>");
+    run_benchmark<bloomfilter_lock::WideBloomFilterLock<bloomfilter_lock::_SpinLock>>("_SpinLock 8 slot keys");
+    bloomfilter_lock::BloomFilterLockOptions read_bias;
+    read_bias.read_bias = true;
+    run_benchmark<bloomfilter_lock::BloomFilterLock<bloomfilter_lock::_SpinLock>>("_SpinLock read bias", read_bias);
+    run_benchmark<bloomfilter_lock::BloomFilterLock<bloomfilter_lock::_SpinLock, bloomfilter_lock::FutexWaitPolicy,
+        bloomfilter_lock::FixedMergeLimits<>, bloomfilter_lock::NoInstrumentation, 4, bloomfilter_lock::IndexedTracking>>(
+        "_SpinLock indexed tracking");
+    bloomfilter_lock::BloomFilterLockOptions bounded_arena;
+    bounded_arena.arena_capacity = 16;
+    bounded_arena.record_overflow = bloomfilter_lock::BlockOnOverflow;
+    run_benchmark<bloomfilter_lock::BloomFilterLock<bloomfilter_lock::_SpinLock>>("_SpinLock bounded arena", bounded_arena);
+    bloomfilter_lock::BloomFilterLockOptions writer_preferring;
+    writer_preferring.scheduling = bloomfilter_lock::WriterPreferring;
+    run_benchmark<bloomfilter_lock::BloomFilterLock<bloomfilter_lock::_SpinLock>>("_SpinLock writer preferring",
+                                                                                 writer_preferring);
+    bloomfilter_lock::BloomFilterLockOptions fast_path;
+    fast_path.fast_path = true;
+    run_benchmark<bloomfilter_lock::BloomFilterLock<bloomfilter_lock::_SpinLock>>("_SpinLock fast path", fast_path);
+    run_benchmark<bloomfilter_lock::SharedBloomFilterLock<>>("SharedBloomFilterLock");
+    run_benchmark<bloomfilter_lock::HierarchicalBloomFilterLock<>>("HierarchicalBloomFilterLock");
+    run_single_key_benchmark<bloomfilter_lock::BloomFilterLock<std::mutex>>("std::mutex");
+    run_single_key_benchmark<bloomfilter_lock::BloomFilterLock<std::mutex>>("std::mutex fast path", fast_path);
     return 0;
 }